@@ -0,0 +1,162 @@
+/**************************************************************************
+*
+* bench_command_parser
+*
+* 10/18/2026
+* LBC
+* How fast is command_parser.h?  Fills a big buffer with pipelined commands,
+* feeds it to the parser in recv sized chunks and prints the throughput in
+* GB/s (and lines per second).
+*
+* Notes
+*  - Usage:  bench_command_parser [-s megabytes] [-c chunkbytes] [-n passes]
+*  - Two kinds of traffic:
+*    - short:  what a real client sends ("H\n", "C\r\n", ...).  This
+*      measures the cost per line.
+*    - long:  lines of 64 to 255 bytes.  This measures how fast we can look
+*      for the "\n" (the SIMD part).
+*  - Each pass parses the whole buffer.  We print the best pass, which is the
+*    one least disturbed by everything else running on the machine.
+*  - Build with optimization, and try -mavx2 to see the AVX2 search:
+*         gcc -O2 -o bench_command_parser bench_command_parser.c
+*         gcc -O2 -mavx2 -o bench_command_parser bench_command_parser.c
+*
+***************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "command_parser.h"
+#include "timing.h"
+
+// Define functions
+// Fill buf with short commands like a real client would send
+void fill_short (char *buf, size_t size) {
+  static const char *commands[] = { "H\n", "C\n", "C\r\n", "Q\n", "Help\n", "X\n" };
+  size_t used = 0, len;
+  const char *cmd;
+
+  while (1) {
+    cmd = commands[rand () % 6];
+    len = strlen (cmd);
+    if (used + len > size)
+      break;
+    memcpy (buf + used, cmd, len);
+    used += len;
+  }
+  memset (buf + used, '\n', size - used);
+}
+
+// Fill buf with long lines (64 to 255 bytes plus the "\n")
+void fill_long (char *buf, size_t size) {
+  size_t used = 0, len;
+
+  while (used < size) {
+    len = 64 + (size_t) rand () % 192;
+    if (used + len + 1 > size)
+      len = size - used - 1;
+    memset (buf + used, 'a' + rand () % 26, len);
+    buf[used + len] = '\n';
+    used += len + 1;
+  }
+}
+
+// Parse the whole buffer in chunks.  Returns the number of lines; *checksum keeps the
+// compiler from optimizing the work away.
+unsigned long parse_buffer (const char *data, size_t size, size_t chunk, unsigned long *checksum) {
+  struct cmd_parser parser;
+  char linebuf[CMD_MAX_LINE];
+  struct cmd_line line;
+  const char *buf;
+  size_t len, left, offset;
+  unsigned long lines = 0;
+  int status;
+
+  cmd_parser_init (&parser, linebuf);
+  for (offset = 0; offset < size; offset += len) {
+    buf = data + offset;
+    len = size - offset < chunk ? size - offset : chunk;
+    left = len;
+    while ((status = cmd_parse (&parser, &buf, &left, &line)) != CMD_PARSE_PARTIAL) {
+      lines++;
+      *checksum += line.len + (line.len > 0 ? (unsigned char) line.data[0] : 0) + (unsigned long) status;
+    }
+  }
+  while ((status = cmd_parse_eof (&parser, &line)) != CMD_PARSE_EOF) {
+    lines++;
+    *checksum += line.len;
+  }
+  return lines;
+}
+
+void run (const char *name, const char *data, size_t size, size_t chunk, int passes) {
+  unsigned long lines = 0, checksum = 0;
+  long long start, elapsed, best = -1;
+  int pass;
+
+  for (pass = 0; pass < passes; pass++) {
+    start = now_ns ();
+    lines = parse_buffer (data, size, chunk, &checksum);
+    elapsed = now_ns () - start;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+  printf ("%-6s %8.2f GB/s %10.1f Mlines/s  (%lu lines, checksum %lu)\n", name,
+          (double) size / best, lines * 1000.0 / best, lines, checksum);
+}
+
+int main (int argc, char *argv[])
+{
+  size_t size = 256, chunk = 65536;
+  int passes = 5, opt;
+  char *data;
+
+  while ((opt = getopt (argc, argv, "s:c:n:")) != -1) {
+    switch (opt) {
+    case 's':
+      sscanf (optarg, "%zu", &size);
+      break;
+    case 'c':
+      sscanf (optarg, "%zu", &chunk);
+      break;
+    case 'n':
+      sscanf (optarg, "%d", &passes);
+      break;
+    default:
+      fprintf (stderr, "Usage: %s [-s megabytes] [-c chunkbytes] [-n passes]\n", argv[0]);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (size == 0 || chunk == 0 || passes < 1) {
+    fprintf (stderr, "Usage: %s [-s megabytes] [-c chunkbytes] [-n passes]\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  size *= 1024 * 1024;
+
+  data = malloc (size);
+  if (data == NULL) {
+    fprintf (stderr, "Could not allocate %zu bytes\n", size);
+    exit (EXIT_FAILURE);
+  }
+
+#if defined(__AVX2__)
+  printf ("Line search:  AVX2\n");
+#elif defined(__SSE2__)
+  printf ("Line search:  SSE2\n");
+#else
+  printf ("Line search:  memchr\n");
+#endif
+  printf ("%zu MB in %zu byte chunks, best of %d passes\n", size / (1024 * 1024), chunk, passes);
+
+  srand (1);
+  fill_short (data, size);
+  run ("short", data, size, chunk, passes);
+  fill_long (data, size);
+  run ("long", data, size, chunk, passes);
+
+  free (data);
+  exit (EXIT_SUCCESS);
+}
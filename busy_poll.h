@@ -0,0 +1,263 @@
+/**************************************************************************
+*
+* busy_poll.h
+*
+* 10/18/2026
+* LBC
+* Adaptive busy polling for the servers (simple_server and
+* command_server_tcp, the -b option).
+*
+* Notes
+*  - A blocking read puts the process to sleep until the next message comes
+*    in.  Waking back up (interrupt, scheduler, context switch) adds a chunk
+*    of latency to every request.  Busy polling trades CPU for that latency:
+*    keep trying a non-blocking read for a little while (the "spin budget")
+*    and only go to sleep in "epoll_wait" if nothing shows up.
+*  - busy_poll_recvfrom does this for a server that reads one socket
+*    (simple_server).  busy_poll_epoll_wait does it for an event loop that
+*    watches lots of sockets (command_server_tcp):  it spins on
+*    epoll_wait with a zero timeout instead of on the reads.
+*  - The budget adapts.  Every time a message shows up while we are spinning
+*    the budget doubles (up to the -b value).  Every time we have to go to
+*    sleep anyway it is cut in half.  So a busy client gets the full budget
+*    and an idle server stops burning CPU.
+*  - If the kernel offers it, we also ask it to busy poll the network device
+*    itself:
+*    - SO_BUSY_POLL on each socket we read (needs CAP_NET_ADMIN to go above
+*      the net.core.busy_read sysctl).  busy_poll_init sets it on the one
+*      socket; an event loop calls busy_poll_socket for every client it
+*      accepts.
+*    - EPIOCSPARAMS on the epoll instance (Linux 6.9 and later)
+*    Neither one is required; busy_poll_init just says which ones worked.
+*  - busy_poll_report prints how often a read was ready right away, how often
+*    spinning paid off and how often we had to sleep, plus the CPU time spent
+*    spinning.  busy_poll_format gives the same numbers as a string (the
+*    command_server_tcp L command shows them for every worker).  Use it to
+*    pick a budget:  lots of sleeps means the budget is too small to matter
+*    (or the traffic is too slow to need it).
+*
+***************************************************************************/
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "timing.h"
+
+// Older C libraries don't know about the epoll busy poll parameters yet
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+// Print a report after this many reads
+#define BUSY_POLL_REPORT_EVERY 100000
+// Packets the kernel may pull off the device per epoll busy poll
+#define BUSY_POLL_NAPI_BUDGET 8
+
+struct busy_poll {
+  int epfd;                     // epoll instance we sleep in when the budget runs out
+  long max_ns;                  // Spin budget from the command line
+  long min_ns;                  // Never adapt the budget below this
+  long budget_ns;               // Current (adaptive) spin budget
+  unsigned long ready;          // Reads that had data right away
+  unsigned long spin_hits;      // Reads that got data while spinning
+  unsigned long sleeps;         // Reads that had to sleep in epoll_wait
+  unsigned long long spin_ns;   // Total time spent spinning
+};
+
+// Turn on the kernel's own busy polling for an epoll instance if it has it
+static inline void busy_poll_epoll_params (int epfd, int usecs) {
+  struct epoll_params params;
+
+  memset (&params, 0, sizeof(params));
+  params.busy_poll_usecs = (uint32_t) usecs;
+  params.busy_poll_budget = BUSY_POLL_NAPI_BUDGET;
+  params.prefer_busy_poll = 1;
+  if (ioctl (epfd, EPIOCSPARAMS, &params) == 0)
+    printf ("epoll busy poll enabled (%d us)\n", usecs);
+  else
+    printf ("epoll busy poll not available (%s)\n", strerror (errno));
+}
+
+// Ask the kernel to busy poll the device when a read on fd would block.  Returns 0 on
+// success, -1 if the kernel (or our privileges) won't do it.
+static inline int busy_poll_socket (int fd, int usecs) {
+  return setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+}
+
+// Get ready to busy poll an event loop that sleeps in epfd, with a spin budget of
+// budget_us microseconds.  The caller owns epfd.
+static inline void busy_poll_init_epoll (struct busy_poll *bp, int epfd, long budget_us) {
+  bp->epfd = epfd;
+  bp->max_ns = budget_us * 1000L;
+  bp->min_ns = bp->max_ns / 64;
+  if (bp->min_ns == 0 && bp->max_ns > 0)
+    bp->min_ns = 1;
+  bp->budget_ns = bp->max_ns;
+  bp->ready = bp->spin_hits = bp->sleeps = 0;
+  bp->spin_ns = 0;
+  busy_poll_epoll_params (epfd, (int) budget_us);
+}
+
+// Get ready to busy poll fd with a spin budget of budget_us microseconds.
+// Returns 0 on success, -1 on error.
+static inline int busy_poll_init (struct busy_poll *bp, int fd, long budget_us) {
+  struct epoll_event ev;
+  int epfd, usecs = (int) budget_us;
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1)
+    return -1;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    close (epfd);
+    return -1;
+  }
+
+  // Optional kernel help.  Just say what we got.
+  if (busy_poll_socket (fd, usecs) == 0)
+    printf ("SO_BUSY_POLL enabled (%d us)\n", usecs);
+  else
+    printf ("SO_BUSY_POLL not available (%s)\n", strerror (errno));
+  busy_poll_init_epoll (bp, epfd, budget_us);
+
+  return 0;
+}
+
+// Put the spin versus sleep numbers in buf (one line, no "\n").  Returns what
+// snprintf returns.
+static inline int busy_poll_format (struct busy_poll *bp, char *buf, size_t len) {
+  unsigned long total = bp->ready + bp->spin_hits + bp->sleeps;
+  double scale = total ? 100.0 / total : 0.0;
+
+  return snprintf (buf, len, "%lu waits, %.1f%% ready, %.1f%% spin, %.1f%% sleep, %.3f ms spinning, budget %.1f us",
+                   total, scale * bp->ready, scale * bp->spin_hits, scale * bp->sleeps,
+                   bp->spin_ns / 1e6, bp->budget_ns / 1000.0);
+}
+
+// Print the spin versus sleep numbers
+static inline void busy_poll_report (struct busy_poll *bp) {
+  char line[256];
+
+  if (bp->ready + bp->spin_hits + bp->sleeps == 0)
+    return;
+  busy_poll_format (bp, line, sizeof(line));
+  printf ("Busy poll:  %s\n", line);
+  fflush (stdout);
+}
+
+// Keep score and adapt the budget after a wait.  spun and slept say how the wait
+// went; start is when the spinning started.
+static inline void busy_poll_account (struct busy_poll *bp, int spun, int slept, long long start) {
+  if (slept) {
+    bp->sleeps++;
+    bp->budget_ns /= 2;
+    if (bp->budget_ns < bp->min_ns)
+      bp->budget_ns = bp->min_ns;
+  }
+  else if (spun) {
+    bp->spin_hits++;
+    bp->spin_ns += now_ns () - start;
+    bp->budget_ns *= 2;
+    if (bp->budget_ns > bp->max_ns)
+      bp->budget_ns = bp->max_ns;
+  }
+  else {
+    bp->ready++;
+  }
+
+  if ((bp->ready + bp->spin_hits + bp->sleeps) % BUSY_POLL_REPORT_EVERY == 0)
+    busy_poll_report (bp);
+}
+
+// Same as recvfrom, except we spin on non-blocking reads for up to the current budget
+// before going to sleep.  Use NULL addr/addrlen for a connected (TCP) socket.
+static inline ssize_t busy_poll_recvfrom (struct busy_poll *bp, int fd, void *buf, size_t len,
+                                          struct sockaddr *addr, socklen_t *addrlen) {
+  struct epoll_event ev;
+  socklen_t addrlen_in = addrlen ? *addrlen : 0;
+  long long start = 0, deadline = 0;
+  ssize_t nread;
+  int spun = 0, slept = 0;
+
+  while (1) {
+    if (addrlen)
+      *addrlen = addrlen_in;
+    nread = recvfrom (fd, buf, len, MSG_DONTWAIT, addr, addrlen);
+    if (nread >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      break;
+
+    // Nothing there.  Spin until the budget is used up, then sleep.
+    if (!spun && !slept) {
+      start = now_ns ();
+      deadline = start + bp->budget_ns;
+      spun = 1;
+    }
+    if (!slept && now_ns () < deadline) {
+      cpu_relax ();
+      continue;
+    }
+    if (!slept) {
+      bp->spin_ns += now_ns () - start;
+      slept = 1;
+    }
+    if (epoll_wait (bp->epfd, &ev, 1, -1) == -1 && errno != EINTR)
+      return -1;
+  }
+
+  busy_poll_account (bp, spun, slept, start);
+  return nread;
+}
+
+// Same as epoll_wait, except we spin on epoll_wait with a zero timeout for up to the
+// current budget before going to sleep for timeout_ms (-1 for no timeout).
+static inline int busy_poll_epoll_wait (struct busy_poll *bp, struct epoll_event *events, int maxevents, int timeout_ms) {
+  long long start = 0, deadline = 0;
+  int n, spun = 0;
+
+  while (1) {
+    n = epoll_wait (bp->epfd, events, maxevents, 0);
+    if (n != 0)
+      break;
+    if (!spun) {
+      start = now_ns ();
+      deadline = start + bp->budget_ns;
+      spun = 1;
+    }
+    if (now_ns () >= deadline) {
+      // Out of budget.  Go to sleep.
+      bp->spin_ns += now_ns () - start;
+      n = epoll_wait (bp->epfd, events, maxevents, timeout_ms);
+      if (n > 0)
+        busy_poll_account (bp, spun, 1, start);
+      return n;
+    }
+    cpu_relax ();
+  }
+
+  if (n > 0)
+    busy_poll_account (bp, spun, 0, start);
+  return n;
+}
+
+#endif
@@ -0,0 +1,196 @@
+/**************************************************************************
+*
+* capture.h
+*
+* 10/18/2026
+* LBC
+* Record everything the clients send to a server into a binary capture file
+* so it can be played back later with replay (no sockets, no clients needed).
+* Used by simple_server and command_server_tcp (the -c option).
+*
+* Notes
+*  - The capture file is just a small header followed by records:
+*         struct capture_header   magic "SSCAP002" and the protocol
+*         struct capture_record   timestamp, connection id, payload length, flags
+*         payload                 padded with 0s to a multiple of 8 bytes
+*         struct capture_record   ...
+*  - Everything is 8 byte aligned so replay can "mmap" the file and read the
+*    records right where they sit (no parsing, no copying).
+*  - Timestamps are CLOCK_MONOTONIC nanoseconds.  Only the differences between
+*    records matter.
+*  - A record with a flag set has no payload.  It marks something that
+*    happened to a connection rather than data:
+*    - CAPTURE_FLAG_EOF:  the client hung up (recv returned 0).  The server
+*      handles any last command that had no newline.
+*    - CAPTURE_FLAG_CLOSE:  the server closed the connection.  Nothing else
+*      comes from this connection id.
+*    This way replay can answer the end of a connection the way the server
+*    did, and knows when it can forget about a connection.
+*  - SSCAP001 files (no flags, no close records) aren't read anymore.
+*  - All of command_server_tcp's worker threads write to the same capture
+*    file.  The file is opened with O_APPEND and each record goes out in a
+*    single "writev", so the kernel appends the whole record in one piece and
+*    records from different clients never get mixed up.
+*  - For the command protocol the top bit of the connection id
+*    (CAPTURE_CONN_ADMIN) says the client was allowed to use the admin
+*    commands, so replay can answer it the same way.
+*
+***************************************************************************/
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#define CAPTURE_MAGIC "SSCAP002"
+
+// Which protocol handler replay should feed the payloads through
+#define CAPTURE_PROTO_ECHO 1      // simple_server
+#define CAPTURE_PROTO_COMMAND 2   // command_server_tcp
+
+// Command protocol:  set in conn_id if the connection may use the admin commands
+#define CAPTURE_CONN_ADMIN 0x80000000u
+
+// Record flags
+#define CAPTURE_FLAG_EOF 1        // The client hung up
+#define CAPTURE_FLAG_CLOSE 2      // The server closed the connection
+
+struct capture_header {
+  char magic[8];
+  uint32_t protocol;
+  uint32_t reserved;
+};
+
+struct capture_record {
+  uint64_t ts_ns;       // When the payload was received (CLOCK_MONOTONIC)
+  uint32_t conn_id;     // Which connection (or UDP peer) sent it
+  uint32_t len;         // Payload length, not counting the padding
+  uint32_t flags;       // CAPTURE_FLAG_* (0 for a plain payload)
+  uint32_t reserved;
+};
+
+// Round a payload length up to the next multiple of 8
+#define CAPTURE_ALIGN(len) (((len) + 7) & ~(size_t) 7)
+
+// Create (or truncate) the capture file and write the header.  Returns the file
+// descriptor or -1 on error.
+static inline int capture_open (const char *path, uint32_t protocol) {
+  struct capture_header header;
+  int fd;
+
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+
+  memset (&header, 0, sizeof(header));
+  memcpy (header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.protocol = protocol;
+  if (write (fd, &header, sizeof(header)) != (ssize_t) sizeof(header)) {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Append one record to the capture file.  Returns 0 on success, -1 on error.
+static inline int capture_write (int fd, uint32_t conn_id, const void *payload, size_t len) {
+  static const char padding[8];
+  struct capture_record record;
+  struct iovec iov[3];
+  size_t total;
+
+  record.ts_ns = (uint64_t) now_ns ();
+  record.conn_id = conn_id;
+  record.len = (uint32_t) len;
+  record.flags = 0;
+  record.reserved = 0;
+
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  iov[1].iov_base = (void *) payload;
+  iov[1].iov_len = len;
+  iov[2].iov_base = (void *) padding;
+  iov[2].iov_len = CAPTURE_ALIGN(len) - len;
+  total = sizeof(record) + CAPTURE_ALIGN(len);
+
+  return writev (fd, iov, 3) == (ssize_t) total ? 0 : -1;
+}
+
+// Append a record with no payload that marks the end of a connection (flags is
+// CAPTURE_FLAG_EOF or CAPTURE_FLAG_CLOSE).  Returns 0 on success, -1 on error.
+static inline int capture_write_event (int fd, uint32_t conn_id, uint32_t flags) {
+  struct capture_record record;
+
+  record.ts_ns = (uint64_t) now_ns ();
+  record.conn_id = conn_id;
+  record.len = 0;
+  record.flags = flags;
+  record.reserved = 0;
+  return write (fd, &record, sizeof(record)) == (ssize_t) sizeof(record) ? 0 : -1;
+}
+
+// Give a UDP peer a connection id by hashing its address (FNV-1a).  The same
+// peer always gets the same id, which is all replay needs.
+static inline uint32_t capture_peer_id (const void *addr, size_t addrlen) {
+  const unsigned char *p = addr;
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < addrlen; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Map a whole capture file read-only.  Returns the start of the file (the header)
+// and the size in *size, or NULL if the file can't be mapped or isn't a capture file.
+static inline const struct capture_header *capture_map (const char *path, size_t *size) {
+  const struct capture_header *header;
+  struct stat st;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof(struct capture_header)) {
+    close (fd);
+    return NULL;
+  }
+  header = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (header == MAP_FAILED)
+    return NULL;
+  if (memcmp (header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0) {
+    munmap ((void *) header, st.st_size);
+    return NULL;
+  }
+  *size = st.st_size;
+  return header;
+}
+
+// Step to the next record.  *offset starts at sizeof(struct capture_header) and is
+// moved past the record.  Returns the record (its payload follows right after it)
+// or NULL at the end of the file or if the record runs off the end (a truncated capture).
+static inline const struct capture_record *capture_next (const struct capture_header *header, size_t size, size_t *offset) {
+  const struct capture_record *record;
+
+  if (*offset + sizeof(struct capture_record) > size)
+    return NULL;
+  record = (const struct capture_record *) ((const char *) header + *offset);
+  if (CAPTURE_ALIGN((size_t) record->len) > size - *offset - sizeof(struct capture_record))
+    return NULL;
+  *offset += sizeof(struct capture_record) + CAPTURE_ALIGN((size_t) record->len);
+  return record;
+}
+
+#endif
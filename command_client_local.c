@@ -0,0 +1,159 @@
+/**************************************************************************
+*
+* command_client_local
+*
+* 10/18/2026
+* LBC
+* The client for command_server_local.  Connects to the server's Unix-domain
+* socket, picks up the shared memory and then talks to the server through the
+* ring buffers in shm_ring.h.
+*
+* Notes
+*  - General program flow:
+*    - Open a Unix-domain socket with "socket"
+*    - Connect to the server with "connect"
+*    - Receive the memfd from the server and "mmap" it
+*    - Push commands on the request ring and pop replies off the reply ring
+*  - With just the socket path, the client reads commands from the terminal
+*    (one per line) and prints the replies ... just like using netcat with
+*    command_server_tcp.
+*  - With a count, the client sends that many "C" commands as fast as it can
+*    and prints the round trip latency (min, median, 99th percentile, max).
+*    This is the easy way to compare against the TCP server.
+*
+***************************************************************************/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "shm_ring.h"
+#include "timing.h"
+
+// Set the size of the buffer used to send commands and receive replies.
+#define BUF_SIZE SHM_SLOT_SIZE
+// How long (milliseconds) to wait for the server before giving up
+#define REPLY_MS 5000
+
+// Define functions
+int compare_ll (const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+
+  struct sockaddr_un unixsockaddr;
+  struct shm_channel *channel;
+  int sfd, mfd;
+  long count = 0, i;
+  ssize_t nread;
+  char buf[BUF_SIZE];
+  long long start, *latency;
+
+  if (argc != 2 && argc != 3) {
+      fprintf(stderr, "Usage: %s socketpath [count]\n", argv[0]);
+      exit(EXIT_FAILURE);
+  }
+  if (argc == 3)
+      sscanf (argv[2], "%ld", &count);
+
+  if (strlen(argv[1]) >= sizeof(unixsockaddr.sun_path)) {
+      fprintf(stderr, "Socket path too long\n");
+      exit(EXIT_FAILURE);
+  }
+
+  memset(&unixsockaddr, 0, sizeof(struct sockaddr_un));
+  unixsockaddr.sun_family = AF_UNIX;
+  strncpy(unixsockaddr.sun_path, argv[1], sizeof(unixsockaddr.sun_path) - 1);
+
+  sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd == -1) {
+    fprintf(stderr, "Could not create socket\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (connect(sfd, (struct sockaddr *) &unixsockaddr, sizeof(struct sockaddr_un)) != 0) {
+    close(sfd);
+    fprintf(stderr, "Could not connect to %s\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Pick up the shared memory from the server and map it in.  Keep the socket open;
+  // the server uses it to notice when we go away.
+  mfd = shm_recv_fd(sfd);
+  if (mfd == -1) {
+    close(sfd);
+    fprintf(stderr, "Could not receive shared memory from server\n");
+    exit(EXIT_FAILURE);
+  }
+  channel = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+  close(mfd);
+  if (channel == MAP_FAILED) {
+    close(sfd);
+    fprintf(stderr, "Could not map shared memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Print the header and prompt from the server
+  nread = shm_ring_pop(&channel->reply, buf, sizeof(buf) - 1, REPLY_MS);
+  if (nread == -1) {
+    fprintf(stderr, "No header from server\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Benchmark mode:  time count round trips
+  if (count > 0) {
+    latency = malloc(count * sizeof(long long));
+    if (latency == NULL) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count; i++) {
+      start = now_ns();
+      if (shm_ring_push(&channel->request, "C\n", 2, REPLY_MS) == -1 ||
+          shm_ring_pop(&channel->reply, buf, sizeof(buf), REPLY_MS) == -1) {
+        fprintf(stderr, "Server stopped responding\n");
+        exit(EXIT_FAILURE);
+      }
+      latency[i] = now_ns() - start;
+    }
+    qsort(latency, count, sizeof(long long), compare_ll);
+    printf("%ld round trips:  min %.2f us, median %.2f us, p99 %.2f us, max %.2f us\n", count,
+           latency[0] / 1000.0, latency[count / 2] / 1000.0,
+           latency[(count * 99) / 100] / 1000.0, latency[count - 1] / 1000.0);
+    free(latency);
+    shm_ring_push(&channel->request, "Q\n", 2, REPLY_MS);
+    exit(EXIT_SUCCESS);
+  }
+
+  // Interactive mode:  one command per line
+  buf[nread] = '\0';
+  fputs(buf, stdout);
+  fflush(stdout);
+  while (fgets(buf, sizeof(buf), stdin) != NULL) {
+    if (shm_ring_push(&channel->request, buf, strlen(buf), REPLY_MS) == -1) {
+      fprintf(stderr, "Server stopped responding\n");
+      exit(EXIT_FAILURE);
+    }
+    nread = shm_ring_pop(&channel->reply, buf, sizeof(buf) - 1, REPLY_MS);
+    if (nread == -1) {
+      fprintf(stderr, "Server stopped responding\n");
+      exit(EXIT_FAILURE);
+    }
+    buf[nread] = '\0';
+    fputs(buf, stdout);
+    fflush(stdout);
+    if (strncmp(buf, "Goodbye.", 8) == 0)
+      break;
+  }
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,90 @@
+/**************************************************************************
+*
+* command_dispatch.h
+*
+* 10/18/2026
+* LBC
+* The command protocol used by the command servers.  Pulled out of
+* command_server_tcp so every transport (TCP, local shared memory, ...)
+* answers the client commands exactly the same way.
+*
+* Notes
+*  - command_dispatch fills in the reply for a single command character.  The
+*    caller decides how the reply actually gets to the client (send, ring
+*    buffer, ...).
+*  - command_dispatch_tcp is the command switch of command_server_tcp, which
+*    also has the admin commands.  replay uses it too, so a capture replays
+*    with the same answers the server gave.
+*
+***************************************************************************/
+#ifndef COMMAND_DISPATCH_H
+#define COMMAND_DISPATCH_H
+
+#include <string.h>
+
+// The prompt that ends every reply, the header and prompt sent to the client when
+// it first connects, and the help text
+#define COMMAND_PROMPT "\ncommand:  "
+#define COMMAND_WELCOME "Welcome to Command Server V1.0\n" COMMAND_PROMPT
+#define COMMAND_HELP "Command Server Help.\n\nH(elp):  This help.\nC(ommand):  Print command.\nQ(uit):  Quit.\n"
+// Extra help for the admin commands only command_server_tcp has
+#define COMMAND_ADMIN_HELP "L(ist):  List sessions.\nK(ick) id:  Close session id.\nB(roadcast) text:  Send text to every session.\n"
+
+// Return values for command_dispatch.  CMD_CONTINUE means keep reading commands
+// from the client, CMD_QUIT means the client asked us to close the connection.
+#define CMD_CONTINUE 0
+#define CMD_QUIT 1
+// Returned by command_dispatch_tcp for L, K and B.  Nothing is put in sendbuf; the
+// caller carries out the admin command.
+#define CMD_ADMIN 2
+
+// Process the client command and put the reply in sendbuf.  The reply is always
+// NUL terminated so the caller can use strlen to get the number of bytes to send.
+static inline int command_dispatch (char ccommand, char *sendbuf, size_t sendbuf_len) {
+  const char *reply;
+  int status = CMD_CONTINUE;
+
+  switch (ccommand) {
+    case 'H':
+      reply = COMMAND_HELP COMMAND_PROMPT;
+      break;
+    case 'C':
+      reply = "command\n" COMMAND_PROMPT;
+      break;
+    case 'Q':
+      reply = "Goodbye.\n\n";
+      status = CMD_QUIT;
+      break;
+    default:
+      reply = "Invalid command.\n" COMMAND_PROMPT;
+      break;
+  } // End switch
+
+  strncpy (sendbuf, reply, sendbuf_len);
+  sendbuf[sendbuf_len - 1] = '\0';
+  return status;
+}
+
+// The command_server_tcp version of command_dispatch.  admin says whether the client
+// may use the admin commands; if not, they are just invalid commands and the help
+// doesn't mention them.
+static inline int command_dispatch_tcp (char ccommand, int admin, char *sendbuf, size_t sendbuf_len) {
+  if (!admin)
+    return command_dispatch (ccommand, sendbuf, sendbuf_len);
+
+  switch (ccommand) {
+    case 'H':
+      strncpy (sendbuf, COMMAND_HELP COMMAND_ADMIN_HELP COMMAND_PROMPT, sendbuf_len);
+      sendbuf[sendbuf_len - 1] = '\0';
+      return CMD_CONTINUE;
+    case 'L':
+    case 'K':
+    case 'B':
+      sendbuf[0] = '\0';
+      return CMD_ADMIN;
+    default:
+      return command_dispatch (ccommand, sendbuf, sendbuf_len);
+  }
+}
+
+#endif
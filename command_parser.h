@@ -0,0 +1,183 @@
+/**************************************************************************
+*
+* command_parser.h
+*
+* 10/18/2026
+* LBC
+* An incremental parser for the command protocol.  The client sends one
+* command per line; TCP doesn't care about lines, so a single recv can
+* return half a command, one command or a whole pile of them.  The parser
+* takes whatever recv returned and hands back complete lines one at a time.
+*
+* Notes
+*  - No malloc anywhere.  The only memory is what the caller owns:  the
+*    struct cmd_parser, and a CMD_MAX_LINE buffer (handed to cmd_parser_init)
+*    for the start of a line that got split across two recvs.  The buffer is
+*    only touched for split lines, so the caller can keep it away from the
+*    data it looks at all the time.
+*  - cmd_parse returns one of:
+*    - CMD_PARSE_COMPLETE:  here is a complete line (without the "\n" or
+*      "\r\n").  Call again, there may be more.
+*    - CMD_PARSE_PARTIAL:  used up all the input without finding the end of a
+*      line.  The start of the line is saved; go recv some more.  The line
+*      handed back is empty.
+*    - CMD_PARSE_ERROR:  the line was longer than CMD_MAX_LINE.  The whole
+*      line is thrown away (we skip ahead to the next "\n") and the parser
+*      is ready for the next one, so the caller can just complain to the
+*      client and keep going.
+*  - When recv returns 0 (the client hung up), call cmd_parse_eof.  It hands
+*    back a last line that had no "\n" (if there is one) and then returns
+*    CMD_PARSE_EOF.
+*  - Most of the time the line is returned right out of the caller's buffer
+*    (no copy).  Only a line split across recvs gets copied into the parser.
+*  - Finding the "\n" is the only part that looks at every byte, so
+*    cmd_find_eol checks 32 (AVX2) or 16 (SSE2) bytes at a time, just like
+*    the C library memchr does.  On other CPUs it just calls memchr.
+*
+***************************************************************************/
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Longest line we will accept (not counting the "\n")
+#define CMD_MAX_LINE 256
+
+// Return values for cmd_parse and cmd_parse_eof
+#define CMD_PARSE_PARTIAL 0
+#define CMD_PARSE_COMPLETE 1
+#define CMD_PARSE_ERROR 2
+#define CMD_PARSE_EOF 3
+
+struct cmd_parser {
+  size_t linelen;               // Bytes of the current line saved in line
+  int overflow;                 // Current line is too long, skipping to the next "\n"
+  char *line;                   // CMD_MAX_LINE bytes owned by the caller
+};
+
+// A complete line.  data points into the caller's buffer or into the parser, so it
+// is only good until the next call to cmd_parse.
+struct cmd_line {
+  const char *data;
+  size_t len;
+};
+
+// Start a parser.  line is CMD_MAX_LINE bytes for a line split across recvs; it
+// has to stay put as long as the parser is used.
+static inline void cmd_parser_init (struct cmd_parser *parser, char *line) {
+  parser->linelen = 0;
+  parser->overflow = 0;
+  parser->line = line;
+}
+
+// Find the first "\n" in buf.  Same as memchr (buf, '\n', len).
+static inline const char *cmd_find_eol (const char *buf, size_t len) {
+#if defined(__AVX2__)
+  const __m256i newline32 = _mm256_set1_epi8 ('\n');
+  while (len >= 32) {
+    unsigned int mask = (unsigned int) _mm256_movemask_epi8 (
+      _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) buf), newline32));
+    if (mask != 0)
+      return buf + __builtin_ctz (mask);
+    buf += 32;
+    len -= 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i newline16 = _mm_set1_epi8 ('\n');
+  while (len >= 16) {
+    unsigned int mask = (unsigned int) _mm_movemask_epi8 (
+      _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) buf), newline16));
+    if (mask != 0)
+      return buf + __builtin_ctz (mask);
+    buf += 16;
+    len -= 16;
+  }
+#endif
+  return memchr (buf, '\n', len);
+}
+
+// Save more of a line that got split across recvs.  Anything past CMD_MAX_LINE
+// just marks the line as too long.
+static inline void cmd_parser_save (struct cmd_parser *parser, const char *data, size_t len) {
+  if (parser->overflow || len > CMD_MAX_LINE - parser->linelen) {
+    parser->overflow = 1;
+    return;
+  }
+  memcpy (parser->line + parser->linelen, data, len);
+  parser->linelen += len;
+}
+
+// Hand back the saved line (or the error) and get ready for the next one
+static inline int cmd_parser_finish (struct cmd_parser *parser, struct cmd_line *line) {
+  int overflow = parser->overflow;
+
+  line->data = parser->line;
+  line->len = overflow ? 0 : parser->linelen;
+  parser->linelen = 0;
+  parser->overflow = 0;
+  return overflow ? CMD_PARSE_ERROR : CMD_PARSE_COMPLETE;
+}
+
+// Drop the "\r" telnet puts in front of the "\n"
+static inline void cmd_line_trim (struct cmd_line *line) {
+  if (line->len > 0 && line->data[line->len - 1] == '\r')
+    line->len--;
+}
+
+// Parse the next line out of *buf (*len bytes).  *buf and *len are moved past
+// whatever was used up.  See the notes above for the return values.
+static inline int cmd_parse (struct cmd_parser *parser, const char **buf, size_t *len, struct cmd_line *line) {
+  const char *eol = cmd_find_eol (*buf, *len);
+  size_t used;
+  int status;
+
+  if (eol == NULL) {
+    cmd_parser_save (parser, *buf, *len);
+    *buf += *len;
+    *len = 0;
+    line->data = parser->line;
+    line->len = 0;
+    return CMD_PARSE_PARTIAL;
+  }
+
+  used = (size_t) (eol - *buf);
+  if (parser->linelen == 0 && !parser->overflow) {
+    // The usual case:  the whole line is in this buffer
+    line->data = *buf;
+    line->len = used;
+    status = used > CMD_MAX_LINE ? CMD_PARSE_ERROR : CMD_PARSE_COMPLETE;
+    if (status == CMD_PARSE_ERROR)
+      line->len = 0;
+  }
+  else {
+    cmd_parser_save (parser, *buf, used);
+    status = cmd_parser_finish (parser, line);
+  }
+
+  *buf += used + 1;
+  *len -= used + 1;
+  cmd_line_trim (line);
+  return status;
+}
+
+// The client hung up.  Returns a last line with no "\n" (CMD_PARSE_COMPLETE or
+// CMD_PARSE_ERROR) if there is one, otherwise CMD_PARSE_EOF.
+static inline int cmd_parse_eof (struct cmd_parser *parser, struct cmd_line *line) {
+  int status;
+
+  if (parser->linelen == 0 && !parser->overflow) {
+    line->data = parser->line;
+    line->len = 0;
+    return CMD_PARSE_EOF;
+  }
+  status = cmd_parser_finish (parser, line);
+  cmd_line_trim (line);
+  return status;
+}
+
+#endif
@@ -0,0 +1,250 @@
+/**************************************************************************
+*
+* command_server_local
+*
+* 10/18/2026
+* LBC
+* The command server for clients on the same host.  Instead of going through
+* the whole TCP stack for every command, the client and server share a pair
+* of ring buffers in memory (see shm_ring.h).  The commands themselves are
+* the same as command_server_tcp (see command_dispatch.h).
+* Use command_client_local for the client.
+*
+* Notes
+*  - General program flow:
+*    - Open a Unix-domain socket with "socket"
+*    - Bind the socket to a path in the filesystem with "bind"
+*    - Listen for incoming connections with "listen"
+*    - Accept incoming connections with "accept"
+*    - Create a separate process for the connection with "fork"
+*    - Create the shared memory with "memfd_create", "ftruncate" and "mmap"
+*    - Seal its size with "fcntl" (F_ADD_SEALS) so the client can't shrink it
+*    - Send the memfd to the client over the Unix-domain socket
+*    - Pop commands off the request ring
+*    - Parse the command sent by the client
+*    - Push the reply on the reply ring
+*  - The Unix-domain socket is only used to get started (and to notice when
+*    the client goes away).  None of the commands go through it.
+*  - We don't print a line for every command like command_server_tcp does.
+*    Writing to the terminal takes longer than the whole round trip!
+*
+***************************************************************************/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "command_dispatch.h"
+#include "shm_ring.h"
+
+// Define functions
+void sigchld_handler (int s) {
+  while (waitpid(-1, NULL, WNOHANG) > 0);
+}
+
+// Returns 1 if the client closed its end of the Unix-domain socket
+int client_gone (int asfd) {
+  char byte;
+  return recv (asfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// Set the size of the buffer used to receive commands from client and send data to client.
+#define BUF_SIZE SHM_SLOT_SIZE
+// Set the size of the backlog ... how many connections we hold in the queue
+#define BACKLOG 16
+// How long (milliseconds) to sleep on an empty ring before checking if the client is still there
+#define IDLE_MS 1000
+
+int main(int argc, char *argv[])
+{
+
+  // Define the sockaddr_un structure.  This is a Unix-domain socket address; the
+  // "address" is just a path in the filesystem.
+  struct sockaddr_un unixsockaddr;
+
+  // What is at the socket path already (if anything)
+  struct stat pathstat;
+
+  int sfd, asfd, mfd;
+
+  // The shared memory for one client (request ring and reply ring)
+  struct shm_channel *channel;
+
+  ssize_t nread;
+
+  // Buffers for receiving and sending data from/to client
+  char readbuf[BUF_SIZE];
+  char sendbuf[BUF_SIZE];
+
+  // SIGACTION structure
+  struct sigaction signalaction;
+
+  // Variable to hold the commands from the client and whether the client asked to quit
+  char ccommand;
+  int quit;
+
+  // Chid process ID
+  int cpid;
+
+  // Process the argument
+  if (argc != 2) {
+      fprintf(stderr, "Usage: %s socketpath\n", argv[0]);
+      exit(EXIT_FAILURE);
+  }
+
+  if (strlen(argv[1]) >= sizeof(unixsockaddr.sun_path)) {
+      fprintf(stderr, "Socket path too long\n");
+      exit(EXIT_FAILURE);
+  }
+
+  // Zero out the unixsockaddr struct and fill in the path.  Remove any old socket
+  // file left over from a previous run or "bind" will fail with EADDRINUSE.  Only
+  // a socket though:  a mistyped path shouldn't delete somebody's file.
+  memset(&unixsockaddr, 0, sizeof(struct sockaddr_un));
+  unixsockaddr.sun_family = AF_UNIX;
+  strncpy(unixsockaddr.sun_path, argv[1], sizeof(unixsockaddr.sun_path) - 1);
+  if (lstat(argv[1], &pathstat) == 0) {
+    if (!S_ISSOCK(pathstat.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", argv[1]);
+      exit(EXIT_FAILURE);
+    }
+    unlink(argv[1]);
+  }
+
+  // Open the socket.  AF_UNIX:  Unix-domain (local only), SOCK_STREAM:  connection oriented.
+  sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd == -1) {
+    fprintf(stderr, "Could not create socket\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (bind(sfd, (struct sockaddr *) &unixsockaddr, sizeof(struct sockaddr_un)) != 0) {
+    close(sfd);
+    fprintf(stderr, "Could not bind socket\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Now start the listener
+  if (listen(sfd, BACKLOG) != 0) {
+    close (sfd);
+    fprintf(stderr, "Could not listen on socket\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Setup the signal handler
+  signalaction.sa_handler = sigchld_handler;
+  sigemptyset(&signalaction.sa_mask);
+  signalaction.sa_flags = SA_RESTART;
+  if (sigaction(SIGCHLD, &signalaction, NULL) == -1) {
+    close (sfd);
+    perror("sigaction");
+    exit(EXIT_FAILURE);
+  }
+
+  // Last but not least, the accept loop
+  printf ("Waiting to accept connections on %s ...\n", argv[1]);
+
+  while (1) {
+
+    // Accept the client connection.  Just keep the server running if it fails.
+    asfd = accept(sfd, NULL, NULL);
+    if (asfd == -1) {
+      fprintf(stderr, "Could not accept socket\n");
+      continue;
+    }
+
+    cpid = fork();
+    if (cpid == -1) {
+      close (asfd);
+      close (sfd);
+      fprintf (stderr, "Could not fork process\n");
+      exit (EXIT_FAILURE);
+    }
+
+    // The parent doesn't need the client socket, the child has its own copy
+    if (cpid != 0) {
+      close (asfd);
+      continue;
+    }
+
+    // Everything below runs in the child process
+    close (sfd);
+    printf("Accepted a local connection (pid %d) ...\n", (int) getpid());
+
+    // Create the shared memory for this client.  memfd_create gives us a file that
+    // only lives in memory; ftruncate sets its size and mmap maps it in.  The new
+    // memory is already zero filled so the rings start out empty.  Then seal the size:
+    // if the client could shrink the file, our next ring access would get SIGBUS.
+    mfd = memfd_create("command_server_local", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mfd == -1 || ftruncate(mfd, sizeof(struct shm_channel)) != 0) {
+      fprintf (stderr, "Could not create shared memory\n");
+      _exit (EXIT_FAILURE);
+    }
+    if (fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+      fprintf (stderr, "Could not seal shared memory\n");
+      _exit (EXIT_FAILURE);
+    }
+    channel = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (channel == MAP_FAILED) {
+      fprintf (stderr, "Could not map shared memory\n");
+      _exit (EXIT_FAILURE);
+    }
+
+    // Hand the memory to the client.  Once the client has mapped it we don't need the fd anymore.
+    if (shm_send_fd(asfd, mfd) != 0) {
+      fprintf (stderr, "Could not send shared memory to client\n");
+      _exit (EXIT_FAILURE);
+    }
+    close (mfd);
+
+    // Send a header and prompt to the client.  Just continue on failure.
+    strncpy (sendbuf, COMMAND_WELCOME, sizeof(sendbuf));
+    if (shm_ring_push (&channel->reply, sendbuf, strlen(sendbuf), IDLE_MS) == -1) {
+      fprintf (stderr, "Could not send header to client\n");
+    }
+
+    // While loop for reading commands from client
+    while (1) {
+
+      // Pop the next command off the request ring.  If nothing shows up for a while,
+      // check to see if the client hung up (it can't tell us through the ring if it crashed).
+      nread = shm_ring_pop (&channel->request, readbuf, sizeof(readbuf), IDLE_MS);
+      if (nread == -1) {
+        if (client_gone (asfd)) {
+          printf ("Local connection (pid %d) closed\n", (int) getpid());
+          _exit (EXIT_SUCCESS);
+        }
+        continue;
+      }
+
+      // Process the client command and push the reply.  An empty message is an invalid command.
+      ccommand = nread > 0 ? readbuf[0] : '\0';
+      quit = command_dispatch (ccommand, sendbuf, sizeof(sendbuf));
+      while (shm_ring_push (&channel->reply, sendbuf, strlen(sendbuf), IDLE_MS) == -1) {
+        if (client_gone (asfd)) {
+          printf ("Local connection (pid %d) closed\n", (int) getpid());
+          _exit (EXIT_SUCCESS);
+        }
+      }
+      if (quit == CMD_QUIT) {
+        printf ("Local connection (pid %d) closed\n", (int) getpid());
+        _exit (EXIT_SUCCESS); // Exit the child process
+      }
+
+    } // End client command while
+
+  } // End accept while
+
+  exit (EXIT_SUCCESS);
+
+} // End main
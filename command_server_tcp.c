@@ -1,26 +1,62 @@
 /**************************************************************************
-* 
+*
 * command_server_tcp
 *
 * 12/29/2014
 * LBC
-* A simple C network server (TCP) that illustrates fork and client commands.  
+* A simple C network server (TCP) that illustrates client commands.
 * Use netcat for the client.
 *
 * Notes
-*  - General program flow:  
+*  - General program flow:
 *    - Open a socket with "socket"
 *    - Bind to the open socket with "bind"
 *    - Listen for incoming connections with "listen"
-*    - Accept incoming connections with "accept"
-*    - Use "inet_ntop" to get the hostname of the client (just so you 
-*      can print this information to the terminal)
-*    - Create a separate process for the connection with "fork"
-*    - Use "recv" to read command sent by the client
-*    - Parse the command sent by the client 
-*    - Use "send" to send the data to the client
-*  
+*    - Start a worker thread for each CPU with "pthread_create"
+*    - Each worker waits for something to happen with "epoll_wait":
+*      - A new connection:  "accept" it and use "inet_ntop" to get the
+*        hostname of the client (just so you can print this information to
+*        the terminal)
+*      - A command from a client:  use "recv" to read it and parse it (one
+*        command per line, see command_parser.h)
+*      - Use "send" to send the data to the client
+*  - This server used to fork a process for every client.  Now each worker
+*    thread looks after lots of clients, and keeps what it knows about them
+*    (name, parser, pending output, timers, stats) in its own session table
+*    (see session_table.h).  No other thread ever touches that table, so
+*    there are no locks on the way from recv to send.  That's also why we
+*    don't print a line for every recv and send anymore:  stdout has a lock
+*    of its own that every worker would line up for.  Use "-v" to get the
+*    lines back (and the lock with them), or look at the per session stats
+*    with the L command.
+*  - The admin commands (L, K and B) need every worker.  The worker that gets
+*    the command drops a message in the other workers' mailboxes (see
+*    mailbox.h) and answers the client when they all write back.  Listing
+*    and broadcasting go through the table a piece at a time (LIST_BATCH),
+*    so a big table never holds up the clients of the worker doing it.  If
+*    an answer gets lost (every mailbox full) the client can send another
+*    admin command after ADMIN_TIMEOUT_NS.
+*  - The admin commands let a client see everybody's address, hang up on
+*    them and send them text, so only clients connecting from this host
+*    (loopback) get them.  Start the server with "-a" to give them to every
+*    client.  For everyone else L, K and B are just invalid commands.
+*  - A client that quits (or gets kicked) is hung up on once its last reply
+*    has actually gone out, or after CLOSE_TIMEOUT_NS if it stops reading.
+*    While a worker has sessions like that it wakes up every SWEEP_MS to
+*    look for the ones that ran out of time.
+*  - Start the server with "-c capturefile" to record every command into a
+*    capture file (see capture.h).  Use replay to play the file back.
+*  - Start the server with "-b usecs" to busy poll:  each worker spins on
+*    epoll_wait for up to usecs microseconds before going to sleep (see
+*    busy_poll.h).  The L command starts each worker's part of the list
+*    with its spin/sleep numbers.
+*  - Start the server with "-w workers" to pick the number of worker threads
+*    (the default is one per CPU).
+*  - Start the server with "-v" to print a line for every recv and send.
+*  - Compile with -pthread.
+*
 ***************************************************************************/
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,27 +64,737 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <netdb.h>
-#include <sys/wait.h>
 #include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
-// Define functions
-void sigchld_handler (int s) {
-  while (waitpid(-1, NULL, WNOHANG) > 0);
-}
+#include "busy_poll.h"
+#include "capture.h"
+#include "command_dispatch.h"
+#include "command_parser.h"
+#include "mailbox.h"
+#include "session_table.h"
+#include "timing.h"
+
+// Set the size of the buffer used to receive commands from client and send data to client.
+#define BUF_SIZE 512
+// Set the size of the backlog ... how many connections we hold in the queue
+#define BACKLOG 16
+// How many epoll events a worker takes at a time
+#define MAX_EVENTS 64
+// How many mailbox messages a worker handles before getting back to its clients
+#define MAILBOX_BATCH 64
+// How many table slots a list or broadcast looks at before getting back to the clients
+#define LIST_BATCH 256
+// Most output we hold for a client that isn't reading.  After that we hang up on it.
+#define OUT_MAX 65536
+// How long a client waits for the answer to an admin command before it may send another
+#define ADMIN_TIMEOUT_NS 5000000000LL
+// How long we wait for a closing session's last output to go out, and how often we check
+#define CLOSE_TIMEOUT_NS 10000000000LL
+#define SWEEP_MS 1000
+
+// epoll tokens for the listening socket and the mailbox.  Everything else is a session
+// token (fd and generation, see session_table.h).
+#define TOKEN_LISTEN UINT64_MAX
+#define TOKEN_MAILBOX (UINT64_MAX - 1)
+
+// Messages between workers
+#define MSG_LIST 1        // List your sessions from fd on (-1 to start; arg is the count so far)
+#define MSG_KICK 2        // Close session fd/gen
+#define MSG_BROADCAST 3   // Send text to your sessions from fd on
+#define MSG_TEXT 4        // Send text to session fd/gen (part of a list)
+#define MSG_DONE 5        // Finished an admin command for session fd/gen (arg is the list count or -1)
+
+// Everything a worker thread owns
+struct worker {
+  int id;
+  pthread_t thread;
+  int epfd;                     // Where the worker waits
+  int evfd;                     // eventfd the other workers ring after posting to the mailbox
+  struct session_table table;
+  unsigned long closing;        // Sessions waiting for their last output to go out
+  long long next_sweep_ns;      // When to look for closing sessions that ran out of time
+  struct busy_poll bp;
+  struct mailbox mailbox;
+};
+
+// Shared by all the workers, but only written before they start (or atomic)
+struct worker *workers;
+int nworkers;
+int sfd;
+int cfd = -1;
+long busy_us = -1;
+int verbose = 0;
+int admin_any = 0;
+_Atomic uint32_t connids;
 
+// Define functions
 void *get_in_addr (struct sockaddr *socketaddress) { // A helper function to select IPv4 versus IPv6 socket address
-  if (socketaddress->sa_family == AF_INET) 
+  if (socketaddress->sa_family == AF_INET)
     return &(((struct sockaddr_in *)socketaddress)->sin_addr);
   return &(((struct sockaddr_in6 *)socketaddress)->sin6_addr);
 }
 
-// Set the size of the buffer used to receive commands from client and send data to client.
-#define BUF_SIZE 512
-// Set the size of the backlog ... how many connections we hold in the queue
-#define BACKLOG 16
+// Returns 1 if the client is on this host (127.0.0.0/8 or ::1)
+int peer_is_loopback (struct sockaddr *socketaddress) {
+  if (socketaddress->sa_family == AF_INET)
+    return (ntohl(((struct sockaddr_in *)socketaddress)->sin_addr.s_addr) >> 24) == 127;
+  return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *)socketaddress)->sin6_addr);
+}
+
+// Drop a message in a worker's mailbox and wake it up.  Returns 0 on success, -1 if
+// the mailbox is full.
+int worker_post (int to, const struct message *msg) {
+  uint64_t one = 1;
+
+  if (mailbox_post (&workers[to].mailbox, msg) != 0)
+    return -1;
+  if (write (workers[to].evfd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+    fprintf (stderr, "Could not wake worker %d\n", to);
+  return 0;
+}
+
+// Fill in who a message is from (the session that asked) and the text
+void message_init (struct message *msg, int type, struct worker *w, struct session *session, const char *text) {
+  memset (msg, 0, offsetof(struct message, text));
+  msg->type = type;
+  msg->from = w->id;
+  if (session != NULL) {
+    msg->from_fd = session_fd (&w->table, session);
+    msg->from_gen = session->gen;
+    msg->seq = session->admin_seq;
+  }
+  msg->len = text ? strlen (text) : 0;
+  if (msg->len > 0)
+    memcpy (msg->text, text, msg->len);
+}
+
+// Close a session and forget it
+void session_end (struct worker *w, struct session *session, const char *why) {
+  int fd = session_fd (&w->table, session);
+
+  printf ("Closed connection from %s (%s)\n", session->peername, why);
+  if (session->closing)
+    w->closing--;
+  if (cfd != -1 && capture_write_event (cfd, session->connid, CAPTURE_FLAG_CLOSE) != 0)
+    fprintf (stderr, "Could not write to capture file\n");
+  epoll_ctl (w->epfd, EPOLL_CTL_DEL, fd, NULL);
+  close (fd);
+  session_close (&w->table, session);
+}
+
+// Send data to a client.  Whatever the socket won't take right now waits in the
+// session's output buffer until epoll says the socket is writable again.  Returns 0
+// on success, -1 if the client is gone or not reading (the caller ends the session).
+int session_send (struct worker *w, struct session *session, const char *data, size_t len) {
+  int fd = session_fd (&w->table, session);
+  struct epoll_event ev;
+  ssize_t nsend = 0;
+
+  if (session->outlen == 0) {
+    nsend = send (fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (nsend == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf (stderr, "Could not send data to client\n");
+        return -1;
+      }
+      nsend = 0;
+    }
+    if (verbose)
+      printf ("Sent %ld bytes to client\n", (long) nsend);
+    session->bytes_out += nsend;
+    if ((size_t) nsend == len)
+      return 0;
+
+    // Start waiting for the socket to be writable
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u64 = session_token (fd, session->gen);
+    epoll_ctl (w->epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  if (session->outlen + len - nsend > OUT_MAX)
+    return -1;
+  if (session->out == NULL) {
+    session->out = malloc (OUT_MAX);
+    if (session->out == NULL)
+      return -1;
+  }
+  memcpy (session->out + session->outlen, data + nsend, len - nsend);
+  session->outlen += len - nsend;
+  return 0;
+}
+
+// The socket is writable again.  Send what we can of the output buffer.
+int session_flush (struct worker *w, struct session *session) {
+  int fd = session_fd (&w->table, session);
+  struct epoll_event ev;
+  ssize_t nsend;
+
+  nsend = send (fd, session->out, session->outlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (nsend == -1)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  session->bytes_out += nsend;
+  session->outlen -= nsend;
+  memmove (session->out, session->out + nsend, session->outlen);
+
+  // All caught up.  Give the buffer back and stop waiting for writable.
+  if (session->outlen == 0) {
+    free (session->out);
+    session->out = NULL;
+    ev.events = EPOLLIN;
+    ev.data.u64 = session_token (fd, session->gen);
+    epoll_ctl (w->epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+  return 0;
+}
+
+// Hang up on a client once everything we sent it has gone out.  Until then we stop
+// reading from it and only wait for the socket to be writable.  From here on last_ns
+// is when we started closing (see worker_sweep).
+void session_finish (struct worker *w, struct session *session, const char *why) {
+  int fd = session_fd (&w->table, session);
+  struct epoll_event ev;
+
+  if (session->outlen == 0) {
+    session_end (w, session, why);
+    return;
+  }
+  if (session->closing == NULL) {
+    w->closing++;
+    if (w->closing == 1)
+      w->next_sweep_ns = now_ns () + SWEEP_MS * 1000000LL;
+  }
+  session->closing = why;
+  session->last_ns = now_ns ();
+  ev.events = EPOLLOUT;
+  ev.data.u64 = session_token (fd, session->gen);
+  epoll_ctl (w->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// Start a new admin command for a session
+void admin_start (struct session *session, int list) {
+  session->admin_seq++;
+  session->admin_start_ns = now_ns ();
+  session->admin_list = list;
+  session->admin_count = 0;
+  session->admin_busy = 0;
+  session->admin_pending = 0;
+}
+
+// Send a reply to the session that asked for an admin command.  Ends the session if
+// the send fails.
+void admin_reply (struct worker *w, struct session *session, const char *text) {
+  if (session_send (w, session, text, strlen (text)) != 0)
+    session_end (w, session, "not reading");
+}
+
+// L:  ask every worker (including this one) to list its sessions
+int admin_list (struct worker *w, struct session *session) {
+  struct message msg;
+  int i;
+
+  admin_start (session, 1);
+  message_init (&msg, MSG_LIST, w, session, NULL);
+  msg.fd = -1;
+  msg.arg = 0;
+  if (session_send (w, session, "Sessions:\n", 10) != 0)
+    return -1;
+  for (i = 0; i < nworkers; i++) {
+    if (worker_post (i, &msg) == 0)
+      session->admin_pending++;
+    else
+      session->admin_busy++;
+  }
+  if (session->admin_pending == 0)
+    return session_send (w, session, "Server busy.\n" COMMAND_PROMPT, strlen ("Server busy.\n" COMMAND_PROMPT));
+  return 0;
+}
+
+// K worker.fd.gen:  ask the worker that owns the session to close it
+int admin_kick (struct worker *w, struct session *session, const struct cmd_line *line) {
+  char text[CMD_MAX_LINE + 1];
+  struct message msg;
+  int worker, fd;
+  unsigned int gen;
+
+  memcpy (text, line->data, line->len);
+  text[line->len] = '\0';
+  if (sscanf (text + 1, " %d.%d.%u", &worker, &fd, &gen) != 3 || worker < 0 || worker >= nworkers) {
+    strcpy (text, "Invalid session id.\n" COMMAND_PROMPT);
+    return session_send (w, session, text, strlen (text));
+  }
+
+  admin_start (session, 0);
+  message_init (&msg, MSG_KICK, w, session, NULL);
+  msg.fd = fd;
+  msg.gen = gen;
+  session->admin_pending = 1;
+  if (worker_post (worker, &msg) != 0) {
+    session->admin_pending = 0;
+    strcpy (text, "Server busy.\n" COMMAND_PROMPT);
+    return session_send (w, session, text, strlen (text));
+  }
+  return 0;
+}
+
+// B text:  ask every worker to send text to all of its sessions
+int admin_broadcast (struct worker *w, struct session *session, const struct cmd_line *line) {
+  char text[MAILBOX_TEXT_SIZE];
+  struct message msg;
+  size_t len = line->len > 1 ? line->len - 1 : 0;
+  const char *data = line->data + 1;
+  int i, busy = 0;
+
+  // Skip the space after the B and make sure the text fits in a message
+  if (len > 0 && *data == ' ') {
+    data++;
+    len--;
+  }
+  if (len > MAILBOX_TEXT_SIZE - 20)
+    len = MAILBOX_TEXT_SIZE - 20;
+  snprintf (text, sizeof(text), "\nBroadcast:  %.*s\n", (int) len, data);
+
+  message_init (&msg, MSG_BROADCAST, w, session, text);
+  msg.fd = 0;
+  for (i = 0; i < nworkers; i++) {
+    if (worker_post (i, &msg) != 0)
+      busy++;
+  }
+  snprintf (text, sizeof(text), "Broadcast sent%s.\n" COMMAND_PROMPT, busy ? " (some workers were busy)" : "");
+  return session_send (w, session, text, strlen (text));
+}
+
+// Process one line from a client.  Returns CMD_CONTINUE, CMD_QUIT, or -1 if the
+// reply couldn't be sent.
+int session_command (struct worker *w, struct session *session, int status, const struct cmd_line *line) {
+  char sendbuf[BUF_SIZE];
+  char ccommand;
+  int quit;
+
+  // A line that is too long (CMD_PARSE_ERROR) is just an invalid command
+  ccommand = (status == CMD_PARSE_COMPLETE && line->len > 0) ? line->data[0] : '\0';
+  session->commands++;
+
+  // Same switch as replay (see command_dispatch.h).  Only the admin commands are up to us.
+  quit = command_dispatch_tcp (ccommand, session->admin, sendbuf, sizeof(sendbuf));
+  if (quit != CMD_ADMIN) {
+    if (session_send (w, session, sendbuf, strlen(sendbuf)) != 0)
+      return -1;
+    return quit;
+  }
+
+  // One admin command at a time.  If the answer to the last one never came back
+  // (it got lost in a full mailbox) forget about it after a while.
+  if (session->admin_pending > 0 && now_ns () - session->admin_start_ns < ADMIN_TIMEOUT_NS) {
+    strncpy (sendbuf, "Still working on the last admin command.\n" COMMAND_PROMPT, sizeof(sendbuf));
+    return session_send (w, session, sendbuf, strlen(sendbuf));
+  }
+  session->admin_pending = 0;
+  if (ccommand == 'L')
+    return admin_list (w, session);
+  if (ccommand == 'K')
+    return admin_kick (w, session, line);
+  return admin_broadcast (w, session, line);
+}
+
+// The client sent something (or hung up)
+void session_read (struct worker *w, struct session *session) {
+  int fd = session_fd (&w->table, session);
+  char readbuf[BUF_SIZE];
+  struct cmd_line line;
+  const char *parsebuf;
+  size_t parselen;
+  ssize_t nread;
+  int status, quit;
+
+  // Read the commands from the client.  The socket is non-blocking, so this never waits.
+  nread = recv (fd, readbuf, sizeof(readbuf), 0);
+
+  // Don't try to parse anything if the read failed.  Zero bytes means the client
+  // hung up; there may still be a last command without a newline in the parser.
+  if (nread == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    fprintf (stderr, "Could not read from client\n");
+    session_end (w, session, "read error");
+    return;
+  }
+  else if (nread > 0) {
+    if (verbose)
+      printf ("Received %ld bytes from client\n", (long) nread);
+    session->bytes_in += nread;
+    session->last_ns = now_ns ();
+    if (cfd != -1 && capture_write (cfd, session->connid, readbuf, nread) != 0) {
+      fprintf (stderr, "Could not write to capture file\n");
+    }
+  }
+  else if (cfd != -1 && capture_write_event (cfd, session->connid, CAPTURE_FLAG_EOF) != 0) {
+    fprintf (stderr, "Could not write to capture file\n");
+  }
+
+  // Process every complete command we have so far
+  parsebuf = readbuf;
+  parselen = nread;
+  while (1) {
+    if (nread == 0)
+      status = cmd_parse_eof (&session->parser, &line);
+    else
+      status = cmd_parse (&session->parser, &parsebuf, &parselen, &line);
+    if (status == CMD_PARSE_PARTIAL || status == CMD_PARSE_EOF)
+      break;
+
+    quit = session_command (w, session, status, &line);
+    if (quit == -1) {
+      session_end (w, session, "not reading");
+      return;
+    }
+    if (quit == CMD_QUIT) {
+      session_finish (w, session, "quit");
+      return;
+    }
+  }
+
+  if (nread == 0)
+    session_finish (w, session, "client closed the connection");
+}
+
+// Take new connections off the listening socket.  Every worker watches the listening
+// socket; EPOLLEXCLUSIVE wakes just one of them per connection.
+void worker_accept (struct worker *w) {
+  struct sockaddr_storage peer_addr;
+  socklen_t peer_addr_len;
+  struct session *session;
+  struct epoll_event ev;
+  int asfd, i;
+
+  for (i = 0; i < 16; i++) {
+    peer_addr_len = sizeof(peer_addr);
+    asfd = accept4 (sfd, (struct sockaddr *)&peer_addr, &peer_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    // Just keep the server running and issue an error message if you cannot accept the client connection.
+    // EAGAIN just means another worker got there first.
+    if (asfd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf (stderr, "Could not accept socket\n");
+      return;
+    }
+
+    session = session_open (&w->table, asfd);
+    if (session == NULL) {
+      fprintf (stderr, "Too many connections\n");
+      close (asfd);
+      continue;
+    }
+    session->opened_ns = session->last_ns = now_ns ();
+
+    // Only local clients get the admin commands (unless -a).  The capture file
+    // remembers which connections had them so replay answers the same way.
+    session->admin = admin_any || peer_is_loopback ((struct sockaddr *)&peer_addr);
+    session->connid = ((atomic_fetch_add (&connids, 1) + 1) & ~CAPTURE_CONN_ADMIN) |
+                      (session->admin ? CAPTURE_CONN_ADMIN : 0);
+
+    // Kernel busy polling is set per socket, so every client needs it (see busy_poll.h)
+    if (busy_us >= 0)
+      busy_poll_socket (asfd, (int) busy_us);
+
+    // Use your get_in_addr function and inet_ntop to get the name of the client and print to terminal
+    inet_ntop (peer_addr.ss_family, get_in_addr ((struct sockaddr *)&peer_addr), session->peername, sizeof(session->peername));
+    printf ("Accepted a connection from %s (session %d.%d.%u) ...\n", session->peername, w->id, asfd, session->gen);
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = session_token (asfd, session->gen);
+    if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, asfd, &ev) != 0) {
+      session_end (w, session, "could not watch socket");
+      continue;
+    }
+
+    // Send a header and prompt to the client
+    if (session_send (w, session, COMMAND_WELCOME, strlen (COMMAND_WELCOME)) != 0)
+      session_end (w, session, "could not send header");
+  }
+}
+
+// Send a list chunk or the final answer back to the session that asked.  Returns
+// 0 on success, -1 if its worker's mailbox is full.
+int worker_answer (const struct message *request, int type, long arg, const char *text, size_t len) {
+  struct message msg;
+
+  memset (&msg, 0, offsetof(struct message, text));
+  msg.type = type;
+  msg.fd = request->from_fd;
+  msg.gen = request->from_gen;
+  msg.seq = request->seq;
+  msg.arg = arg;
+  msg.len = len;
+  memcpy (msg.text, text, len);
+  return worker_post (request->from, &msg);
+}
+
+// MSG_LIST:  list up to LIST_BATCH slots of the table, then post the rest of the job
+// back to ourselves so our own clients get a turn in between.
+void worker_list (struct worker *w, struct message *request) {
+  char text[MAILBOX_TEXT_SIZE], entry[MAILBOX_TEXT_SIZE];
+  struct session *session;
+  long long now = now_ns ();
+  size_t len = 0;
+  long count = 0;
+  int fd = request->fd, n, end;
+
+  // The first chunk starts with this worker's busy poll numbers (if -b)
+  if (fd < 0) {
+    if (busy_us >= 0) {
+      len = snprintf (text, sizeof(text), "worker %d busy poll:  ", w->id);
+      busy_poll_format (&w->bp, text + len, sizeof(text) - len);
+      len = strlen (text);
+      if (len < sizeof(text) - 1)
+        text[len++] = '\n';
+    }
+    fd = 0;
+  }
+
+  // Past the end of the table:  all that's left is to say we're done
+  if (fd > w->table.max_fd && len == 0) {
+    if (worker_answer (request, MSG_DONE, request->arg, "", 0) != 0 && worker_post (w->id, request) != 0)
+      fprintf (stderr, "Could not answer list request\n");
+    return;
+  }
+
+  end = fd + LIST_BATCH;
+  for (; fd <= w->table.max_fd && fd < end; fd++) {
+    session = &w->table.sessions[fd];
+    if (!session->open)
+      continue;
+    n = snprintf (entry, sizeof(entry), "%d.%d.%u  %s  up %llds  idle %llds  %lu commands  %llu/%llu bytes in/out\n",
+                  w->id, fd, session->gen, session->peername, (now - session->opened_ns) / 1000000000LL,
+                  (now - session->last_ns) / 1000000000LL, session->commands, session->bytes_in, session->bytes_out);
+    if (len + n > sizeof(text))
+      break;                    // Full; this one goes in the next chunk
+    memcpy (text + len, entry, n);
+    len += n;
+    count++;
+  }
+
+  // If the asking worker's mailbox is full, do this chunk again later instead of
+  // losing it.  Either way, post the rest of the job back to ourselves.
+  if (len == 0 || worker_answer (request, MSG_TEXT, 0, text, len) == 0) {
+    request->fd = fd;
+    request->arg += count;
+  }
+  if (worker_post (w->id, request) != 0)
+    fprintf (stderr, "Could not continue list request\n");
+}
+
+// MSG_BROADCAST:  same idea as worker_list
+void worker_broadcast (struct worker *w, struct message *request) {
+  struct session *session;
+  int fd = request->fd, end = fd + LIST_BATCH;
+
+  for (; fd <= w->table.max_fd && fd < end; fd++) {
+    session = &w->table.sessions[fd];
+    if (!session->open || session->closing || (request->from == w->id && request->from_fd == fd))
+      continue;
+    if (session_send (w, session, request->text, request->len) != 0)
+      session_end (w, session, "not reading");
+  }
+
+  request->fd = fd;
+  if (fd <= w->table.max_fd && worker_post (w->id, request) != 0)
+    fprintf (stderr, "Could not continue broadcast\n");
+}
+
+// MSG_KICK:  close one of our sessions if it is still the one the admin saw.  If the
+// answer doesn't fit in the asking worker's mailbox, the request comes back to us
+// with arg set and the answer in text, and we just try the answer again.
+void worker_kick (struct worker *w, struct message *request) {
+  struct session *session;
+
+  if (request->arg == 0) {
+    session = session_lookup (&w->table, request->fd, request->gen);
+    if (session != NULL && session->closing == NULL) {
+      if (session_send (w, session, "Disconnected by admin.\n", 23) == 0)
+        session_finish (w, session, "kicked");
+      else
+        session_end (w, session, "kicked");
+      request->len = snprintf (request->text, sizeof(request->text), "Closed session %d.%d.%u\n", w->id, request->fd, request->gen);
+    }
+    else {
+      request->len = snprintf (request->text, sizeof(request->text), "No session %d.%d.%u\n", w->id, request->fd, request->gen);
+    }
+    request->arg = 1;
+  }
+  if (worker_answer (request, MSG_DONE, -1, request->text, request->len) != 0 && worker_post (w->id, request) != 0)
+    fprintf (stderr, "Could not answer kick request\n");
+}
+
+// MSG_TEXT and MSG_DONE:  part of an answer for one of our sessions
+void worker_text (struct worker *w, struct message *msg) {
+  char text[64];
+  struct session *session = session_lookup (&w->table, msg->fd, msg->gen);
+
+  // The session that asked may be gone by now, or have given up on this command
+  if (session == NULL || msg->seq != session->admin_seq)
+    return;
+  if (msg->len > 0 && session_send (w, session, msg->text, msg->len) != 0) {
+    session_end (w, session, "not reading");
+    return;
+  }
+  if (msg->type != MSG_DONE || session->admin_pending == 0)
+    return;
+
+  if (msg->arg > 0)
+    session->admin_count += msg->arg;
+  if (--session->admin_pending > 0)
+    return;
+  if (session->admin_list)
+    snprintf (text, sizeof(text), "%lu sessions%s\n" COMMAND_PROMPT, session->admin_count,
+              session->admin_busy ? " (some workers were busy)" : "");
+  else
+    snprintf (text, sizeof(text), COMMAND_PROMPT);
+  admin_reply (w, session, text);
+}
+
+// Handle what's in the mailbox.  Take at most MAILBOX_BATCH messages so the clients
+// get a turn; if there are more, ring our own eventfd to come back for them.
+void worker_mailbox (struct worker *w) {
+  struct message msg;
+  uint64_t count;
+  int i;
+
+  if (read (w->evfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    fprintf (stderr, "Could not read mailbox eventfd\n");
+
+  for (i = 0; i < MAILBOX_BATCH; i++) {
+    if (!mailbox_take (&w->mailbox, &msg))
+      return;
+    switch (msg.type) {
+      case MSG_LIST:
+        worker_list (w, &msg);
+        break;
+      case MSG_KICK:
+        worker_kick (w, &msg);
+        break;
+      case MSG_BROADCAST:
+        worker_broadcast (w, &msg);
+        break;
+      case MSG_TEXT:
+      case MSG_DONE:
+        worker_text (w, &msg);
+        break;
+    }
+  }
+
+  count = 1;
+  if (write (w->evfd, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN)
+    fprintf (stderr, "Could not wake worker %d\n", w->id);
+}
+
+// Hang up on closing sessions that haven't taken their last output in CLOSE_TIMEOUT_NS
+void worker_sweep (struct worker *w) {
+  struct session *session;
+  long long now = now_ns ();
+  int fd;
+
+  w->next_sweep_ns = now + SWEEP_MS * 1000000LL;
+  for (fd = 0; fd <= w->table.max_fd && w->closing > 0; fd++) {
+    session = &w->table.sessions[fd];
+    if (session->open && session->closing && now - session->last_ns > CLOSE_TIMEOUT_NS)
+      session_end (w, session, "not reading its last reply");
+  }
+}
+
+// The worker thread.  Wait for events and handle them ... forever.
+void *worker_main (void *arg) {
+  struct worker *w = arg;
+  struct epoll_event events[MAX_EVENTS];
+  struct session *session;
+  uint64_t token;
+  int n, i, timeout;
+
+  while (1) {
+    // Only wake up on a timer if there are closing sessions to check on
+    timeout = w->closing > 0 ? SWEEP_MS : -1;
+    if (busy_us >= 0)
+      n = busy_poll_epoll_wait (&w->bp, events, MAX_EVENTS, timeout);
+    else
+      n = epoll_wait (w->epfd, events, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror ("epoll_wait");
+      exit (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+      token = events[i].data.u64;
+      if (token == TOKEN_LISTEN) {
+        worker_accept (w);
+        continue;
+      }
+      if (token == TOKEN_MAILBOX) {
+        worker_mailbox (w);
+        continue;
+      }
+
+      // An event for a session.  Skip it if the session was closed (or the fd reused)
+      // since epoll_wait returned.
+      session = session_lookup (&w->table, session_token_fd (token), session_token_gen (token));
+      if (session == NULL)
+        continue;
+      if ((events[i].events & EPOLLOUT) && session_flush (w, session) != 0) {
+        session_end (w, session, "write error");
+        continue;
+      }
+      if (session->closing) {
+        if (session->outlen == 0 || (events[i].events & (EPOLLHUP | EPOLLERR)))
+          session_end (w, session, session->closing);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        session_read (w, session);
+    }
+
+    if (w->closing > 0 && now_ns () >= w->next_sweep_ns)
+      worker_sweep (w);
+  }
+
+  return NULL;
+}
+
+// Set up a worker:  its epoll instance, mailbox and session table.  Returns 0 on success.
+int worker_init (struct worker *w, int id, int tablesize) {
+  struct epoll_event ev;
+
+  w->id = id;
+  mailbox_init (&w->mailbox);
+  if (session_table_init (&w->table, tablesize) != 0)
+    return -1;
+
+  w->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  w->evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (w->epfd == -1 || w->evfd == -1)
+    return -1;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = TOKEN_MAILBOX;
+  if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) != 0)
+    return -1;
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.u64 = TOKEN_LISTEN;
+  if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, sfd, &ev) != 0)
+    return -1;
+
+  if (busy_us >= 0)
+    busy_poll_init_epoll (&w->bp, w->epfd, busy_us);
+  return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -57,42 +803,58 @@ int main(int argc, char *argv[])
   // thus the name sockaddr_in (socket address _ internet)!
   struct sockaddr_in inetsockaddr;
 
-  int sfd, asfd;
   long int port;
 
-  // Define the rest of the stuff needed for the program.  This includes a special structure
-  // (sockaddr_storage) which is guaranteed to be big enough to store a socket of any size (we 
-  // use this to store the client socket address), length of the client socket address, and number
-  // of bytes read/sent from client.  Note the use of ssize_t instead of int for number of bytes read
-  // or sent.  We use ssize_t (instead of int) to hold either the number of bytes or the value
-  // of an error condition from the read call.  Much more flexible than just a plain int!
-  struct sockaddr_storage peer_addr;
-  socklen_t peer_addr_len;
-  ssize_t nread, nsend;
-
-  // Buffers for receiving and sending data from/to client
-  char readbuf[BUF_SIZE];
-  char sendbuf[BUF_SIZE];
-
   // SIGACTION structure
   struct sigaction signalaction;
 
-  // Variable to hold the client hostname
-  char peername[INET6_ADDRSTRLEN];
+  // Size of the session tables (the most fds we can have open), the CPUs we may run
+  // on and the worker thread we are starting
+  struct rlimit fdlimit;
+  cpu_set_t cpus, cpu;
+  int tablesize, cpunum, i, opt;
 
-  // Variable to hold the commands from the client
-  char ccommand;
+  // One worker for each CPU we are allowed to run on, unless -w says otherwise
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0)
+    CPU_ZERO(&cpus);
+  nworkers = CPU_COUNT(&cpus);
 
-  // Chid process ID
-  int cpid;
+  // Process the options and the argument
+  while ((opt = getopt(argc, argv, "c:b:w:av")) != -1) {
+      switch (opt) {
+      case 'c':
+          cfd = capture_open(optarg, CAPTURE_PROTO_COMMAND);
+          if (cfd == -1) {
+              fprintf(stderr, "Could not open capture file %s\n", optarg);
+              exit(EXIT_FAILURE);
+          }
+          break;
+      case 'b':
+          sscanf(optarg, "%ld", &busy_us);
+          break;
+      case 'w':
+          sscanf(optarg, "%d", &nworkers);
+          break;
+      case 'a':
+          admin_any = 1;
+          break;
+      case 'v':
+          verbose = 1;
+          break;
+      default:
+          fprintf(stderr, "Usage: %s [-c capturefile] [-b usecs] [-w workers] [-a] [-v] port\n", argv[0]);
+          exit(EXIT_FAILURE);
+      }
+  }
 
-  // Process the argument
-  if (argc != 2) {
-      fprintf(stderr, "Usage: %s port\n", argv[0]);
+  if (argc - optind != 1) {
+      fprintf(stderr, "Usage: %s [-c capturefile] [-b usecs] [-w workers] [-a] [-v] port\n", argv[0]);
       exit(EXIT_FAILURE);
   }
+  if (nworkers < 1)
+      nworkers = 1;
 
-  sscanf (argv[1], "%ld", &port);
+  sscanf (argv[optind], "%ld", &port);
 
   // Use "memset" to fill the inetsockaddr struct with a bunch of 0s.  This
   // will "initialize" the empty struct and make sure there is no left
@@ -102,23 +864,24 @@ int main(int argc, char *argv[])
   // First, populate the inetsockaddr struct members. The address family has to be
   // set to AF_INET.  Use INADDR_ANY (bind to any address ... 0.0.0.0) for the internet
   // address.  And get the port number from the command line.  Note that the port number
-  // has to be supplied in "network byte order".  Use htons() to translate a decimal to 
+  // has to be supplied in "network byte order".  Use htons() to translate a decimal to
   // "network byte order".
   inetsockaddr.sin_family = AF_INET;
   inetsockaddr.sin_addr.s_addr = INADDR_ANY;
   inetsockaddr.sin_port = htons((uint16_t)port);
- 
-  // Second, try to open the socket with a call to "socket".  It'll either return an 
+
+  // Second, try to open the socket with a call to "socket".  It'll either return an
   // integer file descriptor or an error.  Here's the parameters:
   //   AF_INET:  Address Family - Internet.  It has to match what we used in inetsockaddr.
   //   SOCK_STREAM:  TCP
+  //   SOCK_NONBLOCK:  accept never waits (all the workers watch this socket)
   //   0:  Protocol (use 0 to indicate default protocol associated with AF_INET)
-  sfd = socket(AF_INET, SOCK_STREAM , 0);
+  sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sfd == -1) {
     fprintf(stderr, "Could not create socket\n");
     exit(EXIT_FAILURE);
   }
-  
+
   // Next, if you open the socket, go ahead and try to bind to the socket.
   // The "bind" call returns an integer, 0 means success.
   // A little more info on "bind":  It actually assigns our identified address to the socket.  See "bind"
@@ -134,119 +897,60 @@ int main(int argc, char *argv[])
     close (sfd);
     fprintf(stderr, "Could not listen on socket\n");
     exit(EXIT_FAILURE);
-  } 
+  }
 
-  // Setup the signal handler
-  signalaction.sa_handler = sigchld_handler;
-  sigemptyset(&signalaction.sa_mask); 
+  // Setup the signal handler.  There are no child processes anymore, but a client
+  // that hangs up while we are sending shouldn't kill the whole server.
+  signalaction.sa_handler = SIG_IGN;
+  sigemptyset(&signalaction.sa_mask);
   signalaction.sa_flags = SA_RESTART;
-  if (sigaction(SIGCHLD, &signalaction, NULL) == -1) {
+  if (sigaction(SIGPIPE, &signalaction, NULL) == -1) {
     close (sfd);
     perror("sigaction");
     exit(EXIT_FAILURE);
   }
 
-  // Last but not least, the accept loop
-  printf ("Waiting to accept connections ...\n");
+  // Set up all the workers before any of them start, so every mailbox is ready
+  // before anybody posts to it
+  tablesize = SESSION_MAX_FDS;
+  if (getrlimit(RLIMIT_NOFILE, &fdlimit) == 0 && fdlimit.rlim_cur < (rlim_t) tablesize)
+    tablesize = (int) fdlimit.rlim_cur;
+  workers = calloc(nworkers, sizeof(struct worker));
+  if (workers == NULL) {
+    close (sfd);
+    fprintf(stderr, "Could not allocate workers\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < nworkers; i++) {
+    if (worker_init(&workers[i], i, tablesize) != 0) {
+      close (sfd);
+      fprintf(stderr, "Could not set up worker %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  while (1) {
+  // Last but not least, start the workers.  Each one gets a CPU of its own (the
+  // i'th one we are allowed to run on) so its session table stays in that CPU's cache.
+  printf ("Waiting to accept connections (%d workers) ...\n", nworkers);
 
-    // Accept the client connection
-    peer_addr_len = sizeof(peer_addr);
-    asfd = accept(sfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
-    
-    // Just keep the server running and issue an error message if you cannot accept the client connection
-    if (asfd == -1) {
-      fprintf(stderr, "Could not accept socket\n");
+  cpunum = 0;
+  for (i = 0; i < nworkers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      fprintf(stderr, "Could not start worker %d\n", i);
+      exit(EXIT_FAILURE);
     }
-
-    // Fork the child process. This time, exit with failure if you cannot fork the process.  The child
-    // process will have a duplicate set of file descriptors so you can use the asfd just as you were in the parent process! 
-    cpid = fork();
-    if (cpid == -1) {
-      close (asfd);
-      close (sfd);
-      fprintf (stderr, "Could not fork process\n");
-      exit (EXIT_FAILURE);
+    if (CPU_COUNT(&cpus) > 0) {
+      while (!CPU_ISSET(cpunum % CPU_SETSIZE, &cpus))
+        cpunum++;
+      CPU_ZERO(&cpu);
+      CPU_SET(cpunum % CPU_SETSIZE, &cpu);
+      pthread_setaffinity_np(workers[i].thread, sizeof(cpu), &cpu);
+      cpunum++;
     }
-  
-    // Execute the following block of code in the child process ... cpid will equal 0 in the child process
-    if (cpid == 0) {
-
-      // Use your get_in_addr function and inet_ntop to get the name of the client and print to terminal 
-      inet_ntop(peer_addr.ss_family, get_in_addr((struct sockaddr *)&peer_addr), peername, sizeof(peername));    
-      printf("Accepted a connection from %s ...\n", peername);
-  
-      // Send a header and prompt to the client.  Just continue on failure.
-      strncpy (sendbuf, "Welcome to Command Server V1.0\n\ncommand:  ", sizeof(sendbuf)); 
-      if (send (asfd, sendbuf, sizeof(sendbuf), 0) == -1) {
-        fprintf (stderr, "Could not send header to client\n");
-      }
-  
-      // While loop for reading commands from client
-      while (1) {
-
-        // Read the commands from the client.  The recv function will sit and wait for a command to arrive.
-        // Just continue on failure.
-        nread = recv (asfd, readbuf, sizeof(sendbuf), 0); 
-        if (nread == -1) {
-          fprintf (stderr, "Could not read from client\n");
-        }
-        else {
-          printf ("Received %d bytes from client\n", nread);
-        }
-    
-        // Process the client command. You guessed it ... continue on failure.
-        ccommand = readbuf[0];
-        switch (ccommand) {
-          case 'H':
-            strncpy (sendbuf, "Command Server Help.\n\nH(elp):  This help.\nC(ommand):  Print command.\nQ(uit):  Quit.\n\ncommand:  ", sizeof(sendbuf));
-            nsend = send (asfd, sendbuf, strlen(sendbuf), 0);
-            if (nsend == -1) {
-              fprintf (stderr, "Could not send data to client\n");
-            } 
-            else { 
-              printf ("Sent %d bytes to client\n", nsend);
-            }
-            break;
-          case 'C':
-            strncpy (sendbuf, "command\n\ncommand:  ", sizeof(sendbuf));
-            nsend = send (asfd, sendbuf, strlen(sendbuf), 0);
-            if (nsend == -1) {
-              fprintf (stderr, "Could not send data to client\n");
-            } 
-            else {
-              printf ("Sent %d bytes to client\n", nsend);
-            }
-            break;
-          case 'Q':
-            strncpy (sendbuf, "Goodbye.\n\n", sizeof(sendbuf));
-            nsend = send (asfd, sendbuf, strlen(sendbuf), 0);
-            if (nsend == -1) {
-              fprintf (stderr, "Could not send data to client\n");
-            } 
-            else {
-              printf ("Sent %d bytes to client\n", nsend);
-            }
-            _exit (EXIT_SUCCESS); // Exit the child process
-          default:
-            strncpy (sendbuf, "Invalid command.\n\ncommand:  ", sizeof(sendbuf));
-            nsend = send (asfd, sendbuf, strlen(sendbuf), 0);
-            if (nread == -1) {
-              fprintf (stderr, "Could not send data to client\n");
-            } 
-            else {
-              printf ("Sent %d bytes to client\n", nsend);
-            }
-            break;
-    
-        } // End switch
-
-      } // End client command while
-
-    } // End cpid if
-
-  } // End accept while
+  }
+
+  for (i = 0; i < nworkers; i++)
+    pthread_join(workers[i].thread, NULL);
 
   exit (EXIT_SUCCESS);
 
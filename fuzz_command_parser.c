@@ -0,0 +1,183 @@
+/**************************************************************************
+*
+* fuzz_command_parser
+*
+* 10/18/2026
+* LBC
+* A libFuzzer harness for command_parser.h.  Build and run it with clang:
+*     clang -g -O1 -fsanitize=fuzzer,address,undefined fuzz_command_parser.c
+*     ./a.out
+* No clang?  gcc builds a stand-alone version that runs the same checks on
+* random inputs (or on the files named on the command line):
+*     gcc -g -O1 -fsanitize=address,undefined -DFUZZ_STANDALONE fuzz_command_parser.c
+*
+* Notes
+*  - The first byte of the input picks how to chop the rest of the input up,
+*    just like recv would chop up a TCP stream.  The rest is parsed twice:
+*    once in one piece and once in chunks.  Both runs have to hand back
+*    exactly the same lines, errors and EOF.
+*  - Along the way we check the things the server counts on:
+*    - A line is never longer than CMD_MAX_LINE and never contains a "\n"
+*    - A line points into the input or into the parser, never anywhere else
+*    - cmd_parse always uses up some input (no infinite loops)
+*    - The input pointer and length stay in step
+*  - Any problem calls abort() so libFuzzer (or the sanitizers) report it.
+*
+***************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command_parser.h"
+
+// What one call to the parser handed back.  The hash stands in for the line itself.
+struct result {
+  int status;
+  size_t len;
+  uint64_t hash;
+};
+
+// Define functions
+uint64_t hash_line (const struct cmd_line *line) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < line->len; i++) {
+    hash ^= (unsigned char) line->data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void check (int ok, const char *what) {
+  if (!ok) {
+    fprintf (stderr, "fuzz_command_parser:  %s\n", what);
+    abort ();
+  }
+}
+
+// Parse data in chunks of chunk bytes (0 means all at once).  Fills in results and
+// returns how many there are.
+size_t parse_all (const uint8_t *data, size_t size, size_t chunk, struct result *results) {
+  struct cmd_parser parser;
+  char linebuf[CMD_MAX_LINE];
+  struct cmd_line line;
+  const char *buf, *input = (const char *) data;
+  size_t len, before, offset = 0, count = 0;
+  int status;
+
+  cmd_parser_init (&parser, linebuf);
+  if (chunk == 0)
+    chunk = size;
+
+  while (offset < size) {
+    buf = input + offset;
+    len = size - offset < chunk ? size - offset : chunk;
+    offset += len;
+
+    while (1) {
+      before = len;
+      status = cmd_parse (&parser, &buf, &len, &line);
+      check (len < before || (before == 0 && status == CMD_PARSE_PARTIAL), "no progress");
+      check (buf + len == input + offset, "input pointer and length out of step");
+      if (status == CMD_PARSE_PARTIAL) {
+        check (len == 0, "partial with input left over");
+        break;
+      }
+      check (status == CMD_PARSE_COMPLETE || status == CMD_PARSE_ERROR, "bad status");
+      check (line.len <= CMD_MAX_LINE, "line too long");
+      check (line.len == 0 || memchr (line.data, '\n', line.len) == NULL, "newline inside line");
+      check (line.len == 0 ||
+             (line.data >= input && line.data + line.len <= input + size) ||
+             (line.data >= parser.line && line.data + line.len <= parser.line + CMD_MAX_LINE),
+             "line points outside the input and the parser");
+      results[count].status = status;
+      results[count].len = line.len;
+      results[count].hash = hash_line (&line);
+      count++;
+    }
+  }
+
+  // The client hangs up
+  while ((status = cmd_parse_eof (&parser, &line)) != CMD_PARSE_EOF) {
+    check (status == CMD_PARSE_COMPLETE || status == CMD_PARSE_ERROR, "bad status at EOF");
+    check (line.len <= CMD_MAX_LINE, "line too long at EOF");
+    results[count].status = status;
+    results[count].len = line.len;
+    results[count].hash = hash_line (&line);
+    count++;
+    check (count <= size + 1, "EOF never reached");
+  }
+  results[count].status = CMD_PARSE_EOF;
+  results[count].len = 0;
+  results[count].hash = 0;
+  return count + 1;
+}
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size) {
+  struct result *whole, *chunked;
+  size_t nwhole, nchunked, chunk, i;
+
+  if (size == 0)
+    return 0;
+  chunk = data[0] % 64 + 1;
+  data++;
+  size--;
+
+  // At most one result per input byte, plus one for the last line and one for EOF
+  whole = malloc ((size + 2) * sizeof(struct result));
+  chunked = malloc ((size + 2) * sizeof(struct result));
+  check (whole != NULL && chunked != NULL, "out of memory");
+
+  nwhole = parse_all (data, size, 0, whole);
+  nchunked = parse_all (data, size, chunk, chunked);
+  check (nwhole == nchunked, "chunked parse returned a different number of lines");
+  for (i = 0; i < nwhole; i++) {
+    check (whole[i].status == chunked[i].status && whole[i].len == chunked[i].len &&
+           whole[i].hash == chunked[i].hash, "chunked parse returned different lines");
+  }
+
+  free (whole);
+  free (chunked);
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// Run the files named on the command line, or a bunch of random inputs made mostly
+// of the characters the parser cares about.
+int main (int argc, char *argv[]) {
+  static const char alphabet[] = "HCQ\n\n\r x";
+  static uint8_t data[4096];
+  size_t size, i;
+  long n;
+  FILE *fp;
+  int arg;
+
+  if (argc > 1) {
+    for (arg = 1; arg < argc; arg++) {
+      fp = fopen (argv[arg], "rb");
+      if (fp == NULL) {
+        fprintf (stderr, "Could not open %s\n", argv[arg]);
+        exit (EXIT_FAILURE);
+      }
+      size = fread (data, 1, sizeof(data), fp);
+      fclose (fp);
+      LLVMFuzzerTestOneInput (data, size);
+    }
+    return 0;
+  }
+
+  srand (1);
+  for (n = 0; n < 20000; n++) {
+    size = (size_t) rand () % sizeof(data);
+    for (i = 0; i < size; i++)
+      data[i] = rand () % 4 == 0 ? (uint8_t) rand () : (uint8_t) alphabet[rand () % (sizeof(alphabet) - 1)];
+    // Now and then make a really long line
+    if (n % 16 == 0 && size > 2 * CMD_MAX_LINE)
+      memset (data + 1, 'A', CMD_MAX_LINE + (size_t) rand () % CMD_MAX_LINE);
+    LLVMFuzzerTestOneInput (data, size);
+  }
+  printf ("20000 random inputs OK\n");
+  return 0;
+}
+#endif
@@ -0,0 +1,112 @@
+/**************************************************************************
+*
+* mailbox.h
+*
+* 10/18/2026
+* LBC
+* Lets the worker threads of command_server_tcp ask each other to do things
+* (list sessions, kick a client, broadcast) without sharing any locks.
+* Every worker owns one mailbox; any worker can drop a message in it.
+*
+* Notes
+*  - A mailbox is a fixed size ring of messages for many producers and one
+*    consumer (the owning worker).  Each cell has a sequence number that says
+*    whether it is free or full, so producers only need one compare-and-swap
+*    to claim a cell and nobody ever waits on anybody else (this is Dmitry
+*    Vyukov's bounded queue).
+*  - mailbox_post never blocks.  If the mailbox is full it returns -1 and the
+*    sender decides what to do (usually tell the client the server is busy).
+*  - After posting, the sender writes to the owner's eventfd so the owner
+*    wakes up in epoll_wait.  The eventfd is the only system call involved.
+*
+***************************************************************************/
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of messages a mailbox holds (must be a power of two)
+#define MAILBOX_SIZE 1024
+// Text carried by one message
+#define MAILBOX_TEXT_SIZE 256
+
+struct message {
+  int type;                     // What to do (up to the program)
+  int fd;                       // Session the message is about ...
+  uint32_t gen;                 // ... and its generation
+  int from;                     // Worker to send the answer to ...
+  int from_fd;                  // ... and the session there that asked ...
+  uint32_t from_gen;            // ... and its generation
+  uint32_t seq;                 // Which of its admin commands this is about
+  long arg;                     // Anything else (a count, a cursor, a flag)
+  size_t len;                   // Bytes used in text
+  char text[MAILBOX_TEXT_SIZE];
+};
+
+struct mailbox_cell {
+  _Atomic size_t seq;
+  struct message msg;
+};
+
+struct mailbox {
+  _Atomic size_t head;          // Next cell a producer claims
+  char pad[64 - sizeof(size_t)];
+  size_t tail;                  // Next cell the owner reads (owner only)
+  struct mailbox_cell cells[MAILBOX_SIZE];
+};
+
+static inline void mailbox_init (struct mailbox *mailbox) {
+  size_t i;
+
+  atomic_init (&mailbox->head, 0);
+  mailbox->tail = 0;
+  for (i = 0; i < MAILBOX_SIZE; i++)
+    atomic_init (&mailbox->cells[i].seq, i);
+}
+
+// Drop a message in the mailbox (any thread).  Returns 0 on success, -1 if the mailbox is full.
+static inline int mailbox_post (struct mailbox *mailbox, const struct message *msg) {
+  struct mailbox_cell *cell;
+  size_t pos = atomic_load_explicit (&mailbox->head, memory_order_relaxed);
+  size_t seq;
+  intptr_t diff;
+
+  while (1) {
+    cell = &mailbox->cells[pos & (MAILBOX_SIZE - 1)];
+    seq = atomic_load_explicit (&cell->seq, memory_order_acquire);
+    diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      // The cell is free; try to claim it.  On failure pos is reloaded for us.
+      if (atomic_compare_exchange_weak_explicit (&mailbox->head, &pos, pos + 1,
+                                                 memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      return -1;                // Full:  the owner hasn't read this cell yet
+    }
+    else {
+      pos = atomic_load_explicit (&mailbox->head, memory_order_relaxed);
+    }
+  }
+
+  cell->msg = *msg;
+  atomic_store_explicit (&cell->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+// Take the next message out of the mailbox (owner only).  Returns 1 if there was
+// one, 0 if the mailbox is empty.
+static inline int mailbox_take (struct mailbox *mailbox, struct message *msg) {
+  struct mailbox_cell *cell = &mailbox->cells[mailbox->tail & (MAILBOX_SIZE - 1)];
+
+  if (atomic_load_explicit (&cell->seq, memory_order_acquire) != mailbox->tail + 1)
+    return 0;
+  *msg = cell->msg;
+  atomic_store_explicit (&cell->seq, mailbox->tail + MAILBOX_SIZE, memory_order_release);
+  mailbox->tail++;
+  return 1;
+}
+
+#endif
@@ -0,0 +1,272 @@
+/**************************************************************************
+*
+* replay
+*
+* 10/18/2026
+* LBC
+* Play a capture file (recorded with "simple_server -c" or
+* "command_server_tcp -c") back through the server's protocol handler.
+* No sockets and no clients, so the same traffic can be run over and over
+* to time the handler code by itself.
+*
+* Notes
+*  - General program flow:
+*    - "mmap" the capture file (see capture.h)
+*    - Walk the records and hand each payload to the protocol handler named
+*      in the capture header (echo or command).  The command handler runs
+*      the payload through the same parser and dispatch as the server.
+*    - Print how many records and bytes went through and how fast
+*  - By default the records go through as fast as possible.  With -p the
+*    records are played at the pace they were recorded (the gaps between the
+*    timestamps are kept).
+*  - Use -n to play the file more than once.  Handy for tiny captures where a
+*    single pass is over before the clock even ticks.
+*  - The digest is a hash of every reply the handler produced.  It should be
+*    the same every time you replay the same file ... if it changes after a
+*    code change, the server answers differently now.
+*  - The command handler follows each connection the way the server did:
+*    nothing after a Q is answered, a client hanging up (CAPTURE_FLAG_EOF)
+*    gets its last line without a newline answered, and a closed connection
+*    (CAPTURE_FLAG_CLOSE) gives its table slot back.  So MAX_CONNS only
+*    limits how many connections are open at the same time.
+*
+***************************************************************************/
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "command_dispatch.h"
+#include "command_parser.h"
+#include "timing.h"
+
+// Set the size of the buffer used for the replies (same as the servers).
+#define BUF_SIZE 512
+// How many connections can be open at the same time (power of two)
+#define MAX_CONNS 4096
+
+// One command parser per connection, just like each command_server_tcp session has
+// its own.  Found by hashing the connection id (open addressing, linear probing).  An
+// entry only counts if it was used in the current pass, so nothing has to be cleared
+// between passes.
+struct conn {
+  long pass;
+  uint32_t conn_id;
+  int quit;                     // Answered a Q; the server ignores the rest
+  struct cmd_parser parser;
+  char line[CMD_MAX_LINE];      // The parser's buffer for split lines
+};
+
+struct conn conns[MAX_CONNS];
+long current_pass;
+
+// Define functions
+
+// Fold a reply into the digest (FNV-1a)
+uint64_t digest_update (uint64_t digest, const char *data, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    digest ^= (unsigned char) data[i];
+    digest *= 1099511628211ULL;
+  }
+  return digest;
+}
+
+// Where a connection id starts looking in the table
+uint32_t conn_home (uint32_t conn_id) {
+  return (conn_id * 2654435761u) & (MAX_CONNS - 1);
+}
+
+// Find (or start) a connection.  Returns NULL if the table is full.
+struct conn *conn_find (uint32_t conn_id) {
+  uint32_t i, slot;
+
+  for (i = 0; i < MAX_CONNS; i++) {
+    slot = (conn_home (conn_id) + i) & (MAX_CONNS - 1);
+    if (conns[slot].pass != current_pass) {
+      conns[slot].pass = current_pass;
+      conns[slot].conn_id = conn_id;
+      conns[slot].quit = 0;
+      cmd_parser_init (&conns[slot].parser, conns[slot].line);
+      return &conns[slot];
+    }
+    if (conns[slot].conn_id == conn_id)
+      return &conns[slot];
+  }
+  return NULL;
+}
+
+// The connection closed; give its slot back.  With linear probing we can't just
+// leave a hole (a lookup would stop there), so the entries after it that belong
+// further up are moved into the hole, one at a time.
+void conn_free (struct conn *conn) {
+  uint32_t hole = (uint32_t) (conn - conns), next = hole;
+
+  conn->pass = 0;
+  while (1) {
+    next = (next + 1) & (MAX_CONNS - 1);
+    if (conns[next].pass != current_pass)
+      return;
+    // The entry can move if its home isn't between the hole and where it is now
+    if (((next - conn_home (conns[next].conn_id)) & (MAX_CONNS - 1)) >= ((next - hole) & (MAX_CONNS - 1))) {
+      conns[hole] = conns[next];
+      conns[hole].parser.line = conns[hole].line;
+      conns[next].pass = 0;
+      hole = next;
+    }
+  }
+}
+
+// simple_server:  the reply is the payload itself (UDP has no connections to end)
+void handle_echo (uint32_t conn_id, uint32_t flags, const char *payload, size_t len, uint64_t *digest) {
+  char sendbuf[BUF_SIZE];
+
+  (void) conn_id;
+  if (flags != 0)
+    return;
+  if (len > BUF_SIZE)
+    len = BUF_SIZE;
+  memcpy (sendbuf, payload, len);
+  *digest = digest_update (*digest, sendbuf, len);
+}
+
+// command_server_tcp:  parse the payload into lines and answer each command (same
+// as the loop in command_server_tcp).  Lines split across records are put back
+// together by the connection's parser.  The answer to an admin command depends on
+// the other sessions, which replay doesn't have, so the command line itself goes
+// into the digest instead.
+void handle_command (uint32_t conn_id, uint32_t flags, const char *payload, size_t len, uint64_t *digest) {
+  struct conn *conn = conn_find (conn_id);
+  struct cmd_line line;
+  char sendbuf[BUF_SIZE];
+  char ccommand;
+  int status, admin = (conn_id & CAPTURE_CONN_ADMIN) != 0;
+
+  if (conn == NULL) {
+    fprintf (stderr, "More than %d open connections in capture file\n", MAX_CONNS);
+    exit (EXIT_FAILURE);
+  }
+  if (flags & CAPTURE_FLAG_CLOSE) {
+    conn_free (conn);
+    return;
+  }
+
+  while (!conn->quit) {
+    // The client hung up:  the server answers a last line that had no newline
+    if (flags & CAPTURE_FLAG_EOF)
+      status = cmd_parse_eof (&conn->parser, &line);
+    else
+      status = cmd_parse (&conn->parser, &payload, &len, &line);
+    if (status == CMD_PARSE_PARTIAL || status == CMD_PARSE_EOF)
+      break;
+
+    ccommand = (status == CMD_PARSE_COMPLETE && line.len > 0) ? line.data[0] : '\0';
+    status = command_dispatch_tcp (ccommand, admin, sendbuf, sizeof(sendbuf));
+    if (status == CMD_ADMIN)
+      *digest = digest_update (*digest, line.data, line.len);
+    else
+      *digest = digest_update (*digest, sendbuf, strlen (sendbuf));
+    if (status == CMD_QUIT)
+      conn->quit = 1;
+  }
+}
+
+// Sleep until the given CLOCK_MONOTONIC time (nanoseconds)
+void sleep_until (uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0);
+}
+
+int main(int argc, char *argv[])
+{
+
+  const struct capture_header *header;
+  const struct capture_record *record;
+  size_t size, offset = sizeof(struct capture_header);
+  void (*handler)(uint32_t, uint32_t, const char *, size_t, uint64_t *);
+
+  int opt, paced = 0;
+  long loops = 1, loop;
+  unsigned long records = 0;
+  uint64_t bytes = 0, digest = 14695981039346656037ULL;
+  uint64_t start, pass_start, elapsed, first_ts;
+  double seconds;
+
+  // Process the options and the argument
+  while ((opt = getopt(argc, argv, "pn:")) != -1) {
+      switch (opt) {
+      case 'p':
+          paced = 1;
+          break;
+      case 'n':
+          sscanf (optarg, "%ld", &loops);
+          break;
+      default:
+          fprintf(stderr, "Usage: %s [-p] [-n loops] capturefile\n", argv[0]);
+          exit(EXIT_FAILURE);
+      }
+  }
+
+  if (argc - optind != 1 || loops < 1) {
+      fprintf(stderr, "Usage: %s [-p] [-n loops] capturefile\n", argv[0]);
+      exit(EXIT_FAILURE);
+  }
+
+  header = capture_map (argv[optind], &size);
+  if (header == NULL) {
+      fprintf(stderr, "Could not read capture file %s\n", argv[optind]);
+      exit(EXIT_FAILURE);
+  }
+
+  // Pick the protocol handler the capture was recorded with
+  switch (header->protocol) {
+    case CAPTURE_PROTO_ECHO:
+      handler = handle_echo;
+      break;
+    case CAPTURE_PROTO_COMMAND:
+      handler = handle_command;
+      break;
+    default:
+      fprintf(stderr, "Unknown protocol %u in capture file\n", header->protocol);
+      exit(EXIT_FAILURE);
+  }
+
+  // The replay loop.  Just walk the mapped file ... no copying.  In paced mode
+  // each pass starts where the last one ended.
+  start = (uint64_t) now_ns ();
+  for (loop = 0; loop < loops; loop++) {
+    pass_start = (uint64_t) now_ns ();
+    first_ts = 0;
+    offset = sizeof(struct capture_header);
+    current_pass = loop + 1;
+    while ((record = capture_next (header, size, &offset)) != NULL) {
+      if (paced) {
+        if (first_ts == 0)
+          first_ts = record->ts_ns;
+        sleep_until (pass_start + (record->ts_ns - first_ts));
+      }
+      handler (record->conn_id, record->flags, (const char *) (record + 1), record->len, &digest);
+      records++;
+      bytes += record->len;
+    }
+  }
+  elapsed = (uint64_t) now_ns () - start;
+
+  if (offset != size)
+    fprintf(stderr, "Warning:  capture file is truncated, the last record was skipped\n");
+
+  seconds = elapsed / 1e9;
+  printf ("Replayed %lu records (%llu bytes) in %.6f s%s\n", records, (unsigned long long) bytes, seconds,
+          paced ? " at recorded pace" : "");
+  if (records > 0 && elapsed > 0)
+    printf ("%.0f records/s, %.2f MB/s, %.1f ns/record\n", records / seconds, bytes / seconds / 1e6,
+            (double) elapsed / records);
+  printf ("Digest %016llx\n", (unsigned long long) digest);
+
+  exit (EXIT_SUCCESS);
+}
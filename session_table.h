@@ -0,0 +1,155 @@
+/**************************************************************************
+*
+* session_table.h
+*
+* 10/18/2026
+* LBC
+* Keeps track of every client connection (a "session") handled by one worker
+* thread of command_server_tcp.  Each worker has its own table, so nothing in
+* here needs a lock.
+*
+* Notes
+*  - The table is a plain array indexed by the socket file descriptor, so
+*    finding the session for an epoll event is just table->sessions[fd].
+*    The array comes straight from "mmap", which gets fresh zero pages from
+*    the kernel; only the slots for fds we actually use ever take up memory.
+*    mmap also starts the array on a page, so with sessions a multiple of 64
+*    bytes long each session starts on a cache line.
+*  - File descriptor numbers get reused as soon as a socket is closed, so an
+*    fd alone isn't enough to name a session.  Every slot has a generation
+*    counter that is bumped when a session is opened and again when it is
+*    closed.  epoll events and messages from other workers carry the fd AND
+*    the generation; session_lookup ignores anything with the wrong
+*    generation (an old event for a session that is already gone).
+*  - A session handle is worker.fd.generation (printed like "2.17.5").  The
+*    worker part says which table to look in.
+*  - The fields the event loop looks at on every read are at the front of
+*    struct session (one cache line); the rest (name, timers, stats) are only
+*    touched now and then.  The parser's buffer for lines split across recvs
+*    is the biggest thing in a session and the least used, so it goes last.
+*
+***************************************************************************/
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "command_parser.h"
+
+// Never make a table bigger than this many fds
+#define SESSION_MAX_FDS 65536
+
+struct session {
+  // Looked at on every event
+  uint32_t gen;                 // Generation, bumped on open and on close
+  int open;
+  int admin_pending;            // Workers that still have to answer an admin command
+  const char *closing;          // Why we are hanging up, once the output is flushed
+  size_t outlen;                // Bytes waiting in out (client not reading fast enough)
+  char *out;                    // Allocated only when a send would block
+  struct cmd_parser parser;
+
+  // Looked at now and then
+  uint32_t connid;              // Connection number (used for capture)
+  int admin;                    // May use the admin commands
+  int admin_list;               // The admin command waiting for answers is a list
+  int admin_busy;               // Workers that were too busy to take it
+  uint32_t admin_seq;           // Number of the admin command waiting for answers
+  long long admin_start_ns;     // When it was sent (we give up after a while)
+  unsigned long admin_count;    // Sessions counted so far for a list command
+  char peername[INET6_ADDRSTRLEN];
+  long long opened_ns;          // When the client connected
+  long long last_ns;            // Last time the client sent something
+  unsigned long commands;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  char line[CMD_MAX_LINE];      // The parser's buffer for split lines
+} __attribute__((aligned(64)));
+
+struct session_table {
+  struct session *sessions;     // Indexed by fd
+  int size;                     // Number of slots
+  int max_fd;                   // Highest fd ever opened (so a list doesn't scan the whole array)
+  unsigned long count;          // Open sessions
+};
+
+// Allocate a table with room for fds 0 .. size-1.  Returns 0 on success, -1 on error.
+static inline int session_table_init (struct session_table *table, int size) {
+  if (size > SESSION_MAX_FDS)
+    size = SESSION_MAX_FDS;
+  table->sessions = mmap (NULL, (size_t) size * sizeof(struct session), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (table->sessions == MAP_FAILED)
+    return -1;
+  table->size = size;
+  table->max_fd = -1;
+  table->count = 0;
+  return 0;
+}
+
+// Start a new session for fd.  Returns NULL if fd doesn't fit in the table.
+static inline struct session *session_open (struct session_table *table, int fd) {
+  struct session *session;
+  uint32_t gen;
+
+  if (fd < 0 || fd >= table->size)
+    return NULL;
+  session = &table->sessions[fd];
+  gen = session->gen + 1;
+  memset (session, 0, sizeof(*session));
+  session->gen = gen;
+  session->open = 1;
+  cmd_parser_init (&session->parser, session->line);
+  if (fd > table->max_fd)
+    table->max_fd = fd;
+  table->count++;
+  return session;
+}
+
+// Find the session for fd, but only if it is still the same one (same generation).
+// Returns NULL for a closed or reused slot.
+static inline struct session *session_lookup (struct session_table *table, int fd, uint32_t gen) {
+  struct session *session;
+
+  if (fd < 0 || fd >= table->size)
+    return NULL;
+  session = &table->sessions[fd];
+  if (!session->open || session->gen != gen)
+    return NULL;
+  return session;
+}
+
+// Forget a session.  The caller closes the socket.
+static inline void session_close (struct session_table *table, struct session *session) {
+  free (session->out);
+  session->out = NULL;
+  session->outlen = 0;
+  session->open = 0;
+  session->gen++;
+  table->count--;
+}
+
+// The fd of a session (its position in the table)
+static inline int session_fd (struct session_table *table, struct session *session) {
+  return (int) (session - table->sessions);
+}
+
+// Pack fd and generation into the 64 bits epoll gives us for each event
+static inline uint64_t session_token (int fd, uint32_t gen) {
+  return ((uint64_t) gen << 32) | (uint32_t) fd;
+}
+
+static inline int session_token_fd (uint64_t token) {
+  return (int) (uint32_t) token;
+}
+
+static inline uint32_t session_token_gen (uint64_t token) {
+  return (uint32_t) (token >> 32);
+}
+
+#endif
@@ -0,0 +1,275 @@
+/**************************************************************************
+*
+* shm_ring.h
+*
+* 10/18/2026
+* LBC
+* Single-producer/single-consumer ring buffers in shared memory.  Used by
+* command_server_local and command_client_local to pass commands and replies
+* without going through the TCP stack.
+*
+* Notes
+*  - General flow:
+*    - The server creates an anonymous memory file with "memfd_create" and
+*      sizes it with "ftruncate" so it holds one shm_channel
+*    - The server hands the memfd to the client over a Unix-domain socket
+*      (SCM_RIGHTS, see shm_send_fd/shm_recv_fd)
+*    - Both sides "mmap" the memfd MAP_SHARED
+*    - The client pushes commands on the request ring and pops replies off the
+*      reply ring.  The server does the opposite.
+*  - Each ring has exactly 1 producer and 1 consumer, so head is only ever
+*    written by the producer and tail is only ever written by the consumer.
+*    No locks needed ... just C11 atomics.
+*  - Waiting:  the consumer spins for a little while (at most SHM_SPIN_NS)
+*    because the next message usually shows up within a couple of
+*    microseconds.  If nothing shows up it raises a "waiters" flag and sleeps
+*    on the head word with "futex".  The producer only makes the futex_wake system call when
+*    the flag is up, so a busy ring never enters the kernel at all.  A full
+*    ring works the same way with the roles reversed (sleep on tail).
+*  - Spinning only pays off when the other side is running on another CPU at
+*    the same time.  With a single CPU the other side can't make progress
+*    while we spin, so instead we hand it the CPU with "sched_yield" a few
+*    times (SHM_YIELD_LOOPS) before going to sleep.
+*  - We use plain FUTEX_WAIT/FUTEX_WAKE (not the _PRIVATE versions) since
+*    the two sides are different processes.
+*
+***************************************************************************/
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "timing.h"
+
+// Number of slots in each ring (must be a power of two) and the size of each slot.
+// A slot holds one whole message, so SHM_SLOT_SIZE matches BUF_SIZE in the servers.
+#define SHM_RING_SLOTS 16
+#define SHM_SLOT_SIZE 512
+// How long to spin before going to sleep in the kernel, and how often to look at the
+// clock while spinning
+#define SHM_SPIN_NS 20000
+#define SHM_SPIN_CHECK 64
+// How many times to yield the CPU (single CPU machines) before going to sleep
+#define SHM_YIELD_LOOPS 8
+// Size of a cache line.  head and tail live on different lines so the producer
+// and consumer don't keep stealing the line from each other.
+#define SHM_CACHE_LINE 64
+
+struct shm_slot {
+  uint32_t len;
+  char data[SHM_SLOT_SIZE];
+};
+
+struct shm_ring {
+  _Atomic uint32_t head;          // Next slot the producer writes (written by producer)
+  _Atomic uint32_t head_waiters;  // Consumer is (about to be) asleep on head
+  char pad0[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+  _Atomic uint32_t tail;          // Next slot the consumer reads (written by consumer)
+  _Atomic uint32_t tail_waiters;  // Producer is (about to be) asleep on tail
+  char pad1[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+  struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+// One channel per client:  commands go client -> server, replies go server -> client.
+struct shm_channel {
+  struct shm_ring request;
+  struct shm_ring reply;
+};
+
+// Thin wrappers around the futex system call (glibc doesn't provide one).
+// shm_futex_wait returns 0 on wakeup, -1 with errno set otherwise (EAGAIN if
+// the word no longer holds val, ETIMEDOUT if the timeout ran out).
+static inline int shm_futex_wait (_Atomic uint32_t *word, uint32_t val, int timeout_ms) {
+  struct timespec ts;
+
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000L;
+  return (int) syscall (SYS_futex, (uint32_t *) word, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static inline void shm_futex_wake (_Atomic uint32_t *word) {
+  syscall (SYS_futex, (uint32_t *) word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Returns 1 if we are running on a single CPU (looked up once)
+static inline int shm_single_cpu (void) {
+  static int ncpus;
+
+  if (ncpus == 0)
+    ncpus = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  return ncpus <= 1;
+}
+
+// Wait until *word is no longer val.  Spin (or yield) first, then sleep on the futex.
+// Returns 0 once the word changed or -1 (errno = ETIMEDOUT) if we slept for
+// timeout_ms and nothing happened.  Use a negative timeout to wait forever.
+static inline int shm_wait_change (_Atomic uint32_t *word, _Atomic uint32_t *waiters, uint32_t val, int timeout_ms) {
+  long long deadline;
+  int i;
+
+  if (shm_single_cpu ()) {
+    for (i = 0; i < SHM_YIELD_LOOPS; i++) {
+      if (atomic_load_explicit (word, memory_order_acquire) != val)
+        return 0;
+      sched_yield ();
+    }
+  }
+  else {
+    deadline = now_ns () + SHM_SPIN_NS;
+    for (i = 1; ; i++) {
+      if (atomic_load_explicit (word, memory_order_acquire) != val)
+        return 0;
+      if (i % SHM_SPIN_CHECK == 0 && now_ns () >= deadline)
+        break;
+      cpu_relax ();
+    }
+  }
+
+  // Raise the flag and look one more time before going to sleep.  Both the flag
+  // store and the producer's head store are seq_cst, so either we see the new
+  // value here or the producer sees our flag and wakes us up.  If the word
+  // changes between this check and the system call, futex returns EAGAIN.
+  atomic_store (waiters, 1);
+  if (atomic_load (word) != val) {
+    atomic_store_explicit (waiters, 0, memory_order_relaxed);
+    return 0;
+  }
+  if (shm_futex_wait (word, val, timeout_ms) == -1 && errno == ETIMEDOUT) {
+    atomic_store_explicit (waiters, 0, memory_order_relaxed);
+    return -1;
+  }
+  atomic_store_explicit (waiters, 0, memory_order_relaxed);
+  return 0;
+}
+
+// Publish a new value for head or tail and wake the other side if it went to sleep
+static inline void shm_publish (_Atomic uint32_t *word, _Atomic uint32_t *waiters, uint32_t val) {
+  atomic_store (word, val);
+  if (atomic_load (waiters))
+    shm_futex_wake (word);
+}
+
+// Push one message on the ring.  Messages longer than SHM_SLOT_SIZE are truncated.
+// Returns 0 on success or -1 (errno = ETIMEDOUT) if the ring stayed full for timeout_ms.
+static inline int shm_ring_push (struct shm_ring *ring, const void *data, size_t len, int timeout_ms) {
+  uint32_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  struct shm_slot *slot;
+
+  while (head - tail == SHM_RING_SLOTS) {
+    if (shm_wait_change (&ring->tail, &ring->tail_waiters, tail, timeout_ms) == -1)
+      return -1;
+    tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  }
+
+  if (len > SHM_SLOT_SIZE)
+    len = SHM_SLOT_SIZE;
+  slot = &ring->slots[head & (SHM_RING_SLOTS - 1)];
+  memcpy (slot->data, data, len);
+  slot->len = (uint32_t) len;
+
+  shm_publish (&ring->head, &ring->head_waiters, head + 1);
+  return 0;
+}
+
+// Pop one message off the ring into buf.  Returns the message length or -1
+// (errno = ETIMEDOUT) if the ring stayed empty for timeout_ms.
+static inline ssize_t shm_ring_pop (struct shm_ring *ring, void *buf, size_t buflen, int timeout_ms) {
+  uint32_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  struct shm_slot *slot;
+  size_t len;
+
+  while (head == tail) {
+    if (shm_wait_change (&ring->head, &ring->head_waiters, head, timeout_ms) == -1)
+      return -1;
+    head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  }
+
+  slot = &ring->slots[tail & (SHM_RING_SLOTS - 1)];
+  len = slot->len;
+  if (len > SHM_SLOT_SIZE)        // Don't trust the other process blindly
+    len = SHM_SLOT_SIZE;
+  if (len > buflen)
+    len = buflen;
+  memcpy (buf, slot->data, len);
+
+  shm_publish (&ring->tail, &ring->tail_waiters, tail + 1);
+  return (ssize_t) len;
+}
+
+// Send a file descriptor over a Unix-domain socket.  The fd rides along as
+// "ancillary data" (SCM_RIGHTS); we also have to send at least 1 byte of
+// regular data.  Returns 0 on success, -1 on error.
+static inline int shm_send_fd (int sock, int fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char byte = 'F';
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  memset (&msg, 0, sizeof(msg));
+  memset (&control, 0, sizeof(control));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy (CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg (sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+// Receive a file descriptor sent with shm_send_fd.  Returns the fd or -1 on error.
+static inline int shm_recv_fd (int sock) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char byte;
+  int fd;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  memset (&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  if (recvmsg (sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return -1;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  memcpy (&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+#endif
@@ -17,6 +17,10 @@
 *    - Use "getnameinfo" to get the hostname and port of the client (just so you 
 *      can print this information to the terminal)
 *    - Use "sendto" to echo the data back to the client
+*  - Start the server with "-c capturefile" to record every datagram into a
+*    capture file (see capture.h).  Use replay to play the file back.
+*  - Start the server with "-b usecs" to busy poll:  spin on non-blocking reads
+*    for up to usecs microseconds before going to sleep (see busy_poll.h).
 *  - The function "getaddrinfo" returns a linked list which can contain more than 1 inet 
 *    socket (this can happen depending on the type of flags you pass via the
 *    hints structure).  So you have to iterate through the linked list (which
@@ -49,6 +53,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 
+#include "busy_poll.h"
+#include "capture.h"
+
 // Set the size of the buffer used to receive messages from client.
 #define BUF_SIZE 512
 
@@ -80,9 +87,35 @@ int main(int argc, char *argv[])
 
   char buf[BUF_SIZE];
 
+  // Capture file descriptor (-1 means we aren't capturing)
+  int cfd = -1;
+  int opt;
+
+  // Busy poll spin budget in microseconds (-1 means plain blocking reads)
+  long busy_us = -1;
+  struct busy_poll bp = { 0 };
 
-  if (argc != 2) {
-      fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // Process the options and the argument
+  while ((opt = getopt(argc, argv, "c:b:")) != -1) {
+      switch (opt) {
+      case 'c':
+          cfd = capture_open(optarg, CAPTURE_PROTO_ECHO);
+          if (cfd == -1) {
+              fprintf(stderr, "Could not open capture file %s\n", optarg);
+              exit(EXIT_FAILURE);
+          }
+          break;
+      case 'b':
+          sscanf(optarg, "%ld", &busy_us);
+          break;
+      default:
+          fprintf(stderr, "Usage: %s [-c capturefile] [-b usecs] port\n", argv[0]);
+          exit(EXIT_FAILURE);
+      }
+  }
+
+  if (argc - optind != 1) {
+      fprintf(stderr, "Usage: %s [-c capturefile] [-b usecs] port\n", argv[0]);
       exit(EXIT_FAILURE);
   }
 
@@ -108,7 +141,7 @@ int main(int argc, char *argv[])
   //   hints = Structure we defined above ... contains the type of socket we want to identify
   //   result = Contains the linked list of addrinfo structs with 1 or more identified sockets
   // The int s contains the return from "getaddrinfo".  Either a 0 (success) or an error.
-  s = getaddrinfo(NULL, argv[1], &hints, &result);
+  s = getaddrinfo(NULL, argv[optind], &hints, &result);
   if (s != 0) {
       fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
       exit(EXIT_FAILURE);
@@ -161,6 +194,12 @@ int main(int argc, char *argv[])
   // result is a pointer and rp points to result, we simoultaneously free the memory for rp (I think).
   freeaddrinfo(result);           /* No longer needed */
 
+  // Set up busy polling on the bound socket if it was asked for
+  if (busy_us >= 0 && busy_poll_init(&bp, sfd, busy_us) != 0) {
+      fprintf(stderr, "Could not set up busy polling\n");
+      exit(EXIT_FAILURE);
+  }
+
   /* Read datagrams and echo them back to sender */
 
   for (;;) {
@@ -177,10 +216,18 @@ int main(int argc, char *argv[])
       //  peer_addr = the address of our client ... note this is case as a sockaddr 
       //  structure
       //  peer_addr_len = the size of the client address (will be different IP4 vs IP6)
-      nread = recvfrom(sfd, buf, BUF_SIZE, 0, (struct sockaddr *) &peer_addr, &peer_addr_len);
+      //  When busy polling, busy_poll_recvfrom takes the same arguments (minus the flags).
+      if (busy_us >= 0)
+          nread = busy_poll_recvfrom(&bp, sfd, buf, BUF_SIZE, (struct sockaddr *) &peer_addr, &peer_addr_len);
+      else
+          nread = recvfrom(sfd, buf, BUF_SIZE, 0, (struct sockaddr *) &peer_addr, &peer_addr_len);
       if (nread == -1)
           continue;               /* Ignore failed request */
 
+      // Record the datagram if we are capturing.  The peer address hash is the connection id.
+      if (cfd != -1 && capture_write(cfd, capture_peer_id(&peer_addr, peer_addr_len), buf, nread) != 0)
+          fprintf(stderr, "Could not write to capture file\n");
+
       // Define a couple of char arrays to hold the names of the client and it's port.
       // We'll use these below with "getnameinfo".  NI_MAXHOST and NI_MAXSERV are platform
       // dependent constants for the maximum allowable length of a hostname and port.
@@ -0,0 +1,39 @@
+/**************************************************************************
+*
+* timing.h
+*
+* 10/18/2026
+* LBC
+* Small helpers shared by everything that spins or keeps time (busy_poll.h,
+* shm_ring.h, capture.h, the servers, clients and benchmarks).
+*
+* Notes
+*  - now_ns is CLOCK_MONOTONIC in nanoseconds.  Monotonic time never jumps
+*    (NTP, someone setting the date), so it is the one to use for timeouts,
+*    spin budgets and measuring how long something took.
+*  - cpu_relax goes in the body of a spin loop.  It tells the CPU we are just
+*    waiting (x86 "pause", ARM "yield"), which saves power and gives the
+*    other hyperthread on the core more room to run.
+*
+***************************************************************************/
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <time.h>
+
+static inline long long now_ns (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Let the CPU know we are in a spin loop
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__ ("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+#endif